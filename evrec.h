@@ -0,0 +1,28 @@
+/*
+ * evrec.h - Input event recordings of hidclient
+ *
+ *	Written by hidclient -R (or mkbench), replayed by hidclient -P.
+ *	A recording is EVREC_MAGIC (not 0-terminated) followed by one
+ *	struct evrec_t per input event, up to the end of the file.
+ *	All multi-byte values are little endian.
+ *
+ * License:	GPL v2, see hidclient.c
+ */
+
+#ifndef	EVREC_H
+#define	EVREC_H
+
+#include <stdint.h>
+
+// Start of a recording, version included
+#define	EVREC_MAGIC	"HCEV0001"
+
+struct evrec_t
+{
+	uint32_t	delta;		// microseconds since the previous event
+	uint16_t	type;		// as in struct input_event
+	uint16_t	code;
+	int32_t		value;
+} __attribute((packed));
+
+#endif
@@ -57,12 +57,46 @@
  * Usage:	hidclient [-h|-?|--help] [-s|--skipsdp]
  * 		Start hidclient. -h will display usage information.
  *		-e<NUM> asks hidclient to ONLY use Input device #NUM
+ *		Otherwise, all keyboards and mice are used, which can be
+ *		narrowed down by rules (vvvv:pppp, vvvv:* in hex, or part of
+ *		the name as listed by -l; -l also shows the result):
+ *		-a<RULE> uses only devices matching an -a rule
+ *		-r<RULE> never uses devices matching the rule
  *		-f<FILENAME> will not read event devices, but create a
  *		   fifo on <FILENAME> and read input_event data blocks
  *		   from there
+ *		-k<FILENAME> will use the binary layout file FILENAME
+ *		   (built by mklayout) instead of the built-in layout, and
+ *		   reload it whenever it is rebuilt
  *		-l will list input devices available
- *		-x will try to remove the "grabbed" input devices from
- *		   the local X11 server, if possible
+ *		-n will report any number of pressed keys (N-key-rollover)
+ *		   instead of at most 8
+ *		-u<PATH> will not use Bluetooth, but offer the control and
+ *		   interrupt channels as Unix domain sockets PATH.ctl and
+ *		   PATH.int (SOCK_SEQPACKET), e.g. for hidhost
+ *		-b<FILENAME> will keep the addresses of the hosts that
+ *		   connected in FILENAME, and dial the last one back, at
+ *		   start and when its link is lost (with -u: the PATH of a
+ *		   host listening with hidhost -l, written by hand)
+ *		-S<PATH> will answer connections to the Unix domain socket
+ *		   PATH with statistics (key=value lines), for monitoring
+ *		   e.g. with "socat - UNIX-CONNECT:PATH"
+ *		-R<FILENAME> will record all input events to FILENAME
+ *		-P<FILENAME> will not use event devices nor Bluetooth, but
+ *		   replay the recording FILENAME through the translation
+ *		   and write the reports as hex lines to stdout, or to
+ *		   -O<FILENAME>; -F replays as fast as possible instead of
+ *		   at the original speed
+ *		-p[R,T,X] will read, translate and send in three threads
+ *		   instead of one, connected by lock-free rings, so a
+ *		   congested radio never holds up reading input; the
+ *		   threads are pinned to CPUs R, T and X if given
+ *		-t will measure the time from each input event (kernel
+ *		   timestamp) until its report was sent, printing a
+ *		   histogram summary on SIGUSR1 and at exit
+ *		-x will grab the input devices (EVIOCGRAB) while input
+ *		   goes to the remote side, so the local machine does not
+ *		   see it; PRINT toggles between local and remote
  * 		-s will disable SDP registration (which only makes sense
  * 		when debugging as most counterparts require SDP to work)
  * Tip:		Use "openvt" along with hidclient so that keystrokes and
@@ -109,24 +143,40 @@
  *
  * Press LCtrg+PRINT to stop the program.
  * Press RCtrg+PRINT to send a string defined in pass.h.
+ * Press LAlt+PRINT to send the input to the next connected host; up to
+ * MAXHOSTS hosts can be connected at the same time.
  */
 
 
 //***************** Include files
+#define	_GNU_SOURCE	// versionsort
 #include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <endian.h>
+#include <time.h>
+#include <sched.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stropts.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <libgen.h>
 #include <linux/input.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -135,14 +185,72 @@
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 #include "pass.h"
+#include "layout.h"
+#include "evrec.h"
 
 //***************** Static definitions
 // Where to find event devices (that must be readable by current user)
 // "%d" to be filled in, opening several devices, see below
 #define	EVDEVNAME	"/dev/input/event%d"
+#define	EVDEVDIR	"/dev/input"
 
-// Maximally, read MAXEVDEVS event devices simultaneously
-#define	MAXEVDEVS 16
+// Initial size of the event device registry, grows on demand
+#define	EVDEVSINIT	16
+
+// Device classes found by evdevclass(): only these are read from
+#define	EVCLASS_KEYBD	1
+#define	EVCLASS_MOUSE	2
+#define	EVCLASS_LED	4	// keyboard with LEDs, see setleds
+// Test bit n in an EVIOCGBIT result (array of unsigned long)
+#define	LONGBITS	( 8 * sizeof(unsigned long) )
+#define	NLONGS(n)	( ( (n) + LONGBITS ) / LONGBITS )
+#define	TESTBIT(a,n)	( ( (a)[(n)/LONGBITS] >> ( (n) % LONGBITS ) ) & 1 )
+
+// Read up to EVBATCH input_events from a device with a single read()
+#define	EVBATCH	64
+
+// Event loop: maximum number of ready descriptors handled per wakeup, and
+// the kind of descriptor, stored in the upper half of epoll_event.data.u64
+#define	EVLOOPMAX	16
+#define	EVL_EVDEV	0	// event device or fifo
+#define	EVL_LISTENCTL	1	// listening socket, control channel
+#define	EVL_LISTENINT	2	// listening socket, interrupt channel
+#define	EVL_CTL		3	// connected control channel
+#define	EVL_INT		4	// connected interrupt channel
+#define	EVL_LAYOUT	5	// inotify watch on the layout file
+#define	EVL_HOTPLUG	6	// inotify watch on the event device directory
+#define	EVL_STATS	7	// listening statistics socket (-S)
+#define	EVL_PIPE	8	// requests from the pipeline threads (-p)
+#define	EVL_DIAL	9	// outgoing connection in progress (-b)
+#define	EVL_DATA(kind,fd)	( ( (uint64_t)(kind) << 32 ) | (uint32_t)(fd) )
+#define	EVL_KIND(data)		( (int)( (data) >> 32 ) )
+#define	EVL_FD(data)		( (int)(uint32_t)(data) )
+
+// Reports queued while the interrupt channel is congested: number of slots
+// and maximum size of one report
+#define	REPQUEUELEN	64
+#define	REPMAXLEN	sizeof(struct hidrep_nkro_t)
+
+// Time the host gets to open the interrupt channel after the control channel
+#define	INTCHANTIMEOUT	3000	// milliseconds
+
+// modifierkeys bits of the real modifiers (0x8000 in keymodifier)
+#define	REALMODS	0x9d
+
+// Hosts connected at the same time; LAlt+PRINT moves the input between them
+#define	MAXHOSTS	4
+// Time the host losing the input gets to take its all-released reports
+// with -p, see transmitter
+#define	RELEASEWAIT	100	// milliseconds
+
+// Known hosts kept in the file given with -b, and the time between two
+// attempts to dial one back: doubled after each failure, up to DIALMAX
+#define	MAXBONDED	8
+#define	DIALMIN		1000	// milliseconds
+#define	DIALMAX		60000
+// Errors of a channel that mean the link was lost, not closed by the host
+#define	LINKLOST(err)	( ( (err) == ETIMEDOUT ) || ( (err) == ECONNRESET ) || \
+			  ( (err) == EHOSTDOWN ) || ( (err) == EHOSTUNREACH ) )
 
 // Bluetooth "ports" (PSMs) for HID usage, standardized to be 17 and 19 resp.
 // In theory you could use different ports, but several implementations seem
@@ -158,33 +266,236 @@
 // These numbers must also be used in the HID descriptor binary file
 #define	REPORTID_MOUSE	1
 #define	REPORTID_KEYBD	2
+// In boot protocol (SET_PROTOCOL) the reports have fixed formats and, on
+// Bluetooth, fixed report ids as well - the other way round
+#define	BOOTID_KEYBD	1
+#define	BOOTID_MOUSE	2
+
+// HID control channel transactions (Bluetooth HID profile): the header
+// byte is the transaction type in the upper, a parameter in the lower nibble
+#define	HIDP_HANDSHAKE		0x00
+#define	HIDP_CONTROL		0x10
+#define	HIDP_GET_REPORT		0x40
+#define	HIDP_SET_REPORT		0x50
+#define	HIDP_GET_PROTOCOL	0x60
+#define	HIDP_SET_PROTOCOL	0x70
+#define	HIDP_GET_IDLE		0x80
+#define	HIDP_SET_IDLE		0x90
+#define	HIDP_DATA		0xA0
+// HANDSHAKE result codes
+#define	HIDP_HSHK_SUCCESSFUL		0x0
+#define	HIDP_HSHK_ERR_INVALID_REPORT_ID	0x2
+#define	HIDP_HSHK_ERR_UNSUPPORTED	0x3
+#define	HIDP_HSHK_ERR_INVALID_PARAMETER	0x4
+// HID_CONTROL operations, GET/SET_REPORT report types
+#define	HIDP_CTRL_VIRTUAL_CABLE_UNPLUG	0x5
+#define	HIDP_REPTYPE_INPUT	0x1
+#define	HIDP_REPTYPE_OUTPUT	0x2
+#define	HIDP_REPTYPE_MASK	0x3
+#define	HIDP_GETREP_SIZE	0x8	// GET_REPORT carries a buffer size
+#define	HIDP_PROTO_BOOT		0x0	// SET_PROTOCOL parameter
+#define	HIDP_PROTO_REPORT	0x1
 
 // Fixed SDP record, corresponding to data structures below. Explanation
 // is in separate text file. No reason to change this if you do not want
 // to fiddle with the data sent over the BT connection as well.
+// The mouse reports X, Y and the wheel (all relative, one byte each).
+// The keyboard also has an output report from the host, one bit per LED
+// (Num Lock, Caps Lock, Scroll Lock, Compose, Kana), see setleds.
 #define SDPRECORD	"\x05\x01\x09\x02\xA1\x01\x85\x01\x09\x01\xA1\x00" \
 			"\x05\x09\x19\x01\x29\x03\x15\x00\x25\x01\x75\x01" \
 			"\x95\x03\x81\x02\x75\x05\x95\x01\x81\x01\x05\x01" \
 			"\x09\x30\x09\x31\x09\x38\x15\x81\x25\x7F\x75\x08" \
-			"\x95\x02\x81\x06\xC0\xC0\x05\x01\x09\x06\xA1\x01" \
+			"\x95\x03\x81\x06\xC0\xC0\x05\x01\x09\x06\xA1\x01" \
 			"\x85\x02\xA1\x00\x05\x07\x19\xE0\x29\xE7\x15\x00" \
 			"\x25\x01\x75\x01\x95\x08\x81\x02\x95\x08\x75\x08" \
-			"\x15\x00\x25\x65\x05\x07\x19\x00\x29\x65\x81\x00" \
+			"\x15\x00\x26\xFF\x00\x05\x07\x19\x00\x2A\xFF\x00" \
+			"\x81\x00\x05\x08\x19\x01\x29\x05\x15\x00\x25\x01" \
+			"\x75\x01\x95\x05\x91\x02\x75\x03\x95\x01\x91\x01" \
 			"\xC0\xC0"
-#define SDPRECORD_BYTES	98
+#define SDPRECORD_BYTES	122
+// Same, but in N-key-rollover mode (-n) the keyboard reports one bit for
+// each of the 256 usages instead of an array of 8 pressed keys
+#define SDPRECORD_NKRO	"\x05\x01\x09\x02\xA1\x01\x85\x01\x09\x01\xA1\x00" \
+			"\x05\x09\x19\x01\x29\x03\x15\x00\x25\x01\x75\x01" \
+			"\x95\x03\x81\x02\x75\x05\x95\x01\x81\x01\x05\x01" \
+			"\x09\x30\x09\x31\x09\x38\x15\x81\x25\x7F\x75\x08" \
+			"\x95\x03\x81\x06\xC0\xC0\x05\x01\x09\x06\xA1\x01" \
+			"\x85\x02\xA1\x00\x05\x07\x19\xE0\x29\xE7\x15\x00" \
+			"\x25\x01\x75\x01\x95\x08\x81\x02\x05\x07\x19\x00" \
+			"\x29\xFF\x15\x00\x25\x01\x75\x01\x96\x00\x01\x81" \
+			"\x02\x05\x08\x19\x01\x29\x05\x15\x00\x25\x01\x75" \
+			"\x01\x95\x05\x91\x02\x75\x03\x95\x01\x91\x01\xC0" \
+			"\xC0"
+#define SDPRECORD_NKRO_BYTES	121
+_Static_assert ( sizeof(SDPRECORD) - 1 == SDPRECORD_BYTES, "SDPRECORD" );
+_Static_assert ( sizeof(SDPRECORD_NKRO) - 1 == SDPRECORD_NKRO_BYTES,
+		"SDPRECORD_NKRO" );
+
+// Range of a relative axis in the mouse report (logical min/max above)
+#define	CLAMPREL(v)	( (v) > 127 ? 127 : ( (v) < -127 ? -127 : (v) ) )
+
+// Latency histogram (-t): log-linear buckets of nanoseconds, exact below
+// 2^LATSUBBITS, above that LATSUBBITS bits below the leading one (~3%)
+#define	LATSUBBITS	5
+#define	LATBUCKETS	( ( 64 - LATSUBBITS + 1 ) << LATSUBBITS )
+
+// Pipelined mode (-p): the reader (main thread) passes input events to the
+// translator thread, which passes reports to the transmitter thread, each
+// through a single-producer/single-consumer ring of PIPEEVENTS/PIPEREPORTS
+// slots (powers of 2). A consumer polls its ring PIPESPIN times before it
+// goes to sleep. Messages on the event ring that are no input events:
+#define	PIPEEVENTS	4096
+#define	PIPEREPORTS	256
+#define	PIPESPIN	2000
+#define	EVP_RESET	0x100	// new connection: forget the key state; value:
+				// txhandoffs[] entry, see pipesession
+#define	EVP_RESYNC	0x101	// code: 32 bit word of held keys, value: the
+				// word; code EVP_RESYNCEND: apply them
+#define	EVP_STOP	0x102	// shutdown, passed on as report of length 0
+#define	EVP_FOCUS	0x103	// input goes to another host (or none), see
+				// switchfocus; value as for EVP_RESET
+#define	EVP_LAYOUT	0x104	// layout changed, see pipelayout
+#define	EVP_RESYNCEND	0xffff
+// Host changes queued for the transmitter at most, see pipesession. A
+// report slot of length REPHANDOFF marks where one happens in repring
+#define	TXHANDOFFS	8
+#define	REPHANDOFF	-1
+// Single-producer/single-consumer ring, see spsc_init. Producer and
+// consumer indexes are kept on separate cache lines
+struct spsc_t
+{
+	unsigned long	head __attribute((aligned(64)));	// producer
+	unsigned long	tail __attribute((aligned(64)));	// consumer
+	int		sleeping __attribute((aligned(64)));	// consumer
+						// waits on wakefd
+	unsigned int	mask;		// slots - 1
+	unsigned int	size;		// bytes per slot
+	unsigned char	*slots;
+	int		wakefd;		// eventfd to wake the consumer
+};
 
 //***************** Function prototypes
+struct session_t;	// see Data structures
+struct hidrep_slot_t;
+struct txhandoff_t;
 int		dosdpregistration(void);
 void		sdpunregister(unsigned int);
 static void	add_lang_attr(sdp_record_t *r);
 int		btbind(int sockfd, unsigned short port);
-int		initevents(int,int);
+int		bt_listen(const char *,unsigned short);
+int		bt_accept(int,char *,int);
+void		bt_cleanup(const char *,unsigned short);
+int		bt_connect(const char *,unsigned short);
+int		unix_listen(const char *,unsigned short);
+int		unix_accept(int,char *,int);
+void		unix_cleanup(const char *,unsigned short);
+int		unix_connect(const char *,unsigned short);
+int		unix_path(struct sockaddr_un *,const char *,unsigned short);
+int		acceptchannel(int,const char *,char *,int);
+int		initevents(int);
+int		openevdev(int);
+void		closeevdev(int);
+struct evdev_t	*evdev_add(int,int);
+void		evdev_del(int);
+int		watchevents(void);
+void		hotplug(int);
+int		grabevents(int);
+int		evdevfilter(const struct dirent *);
+int		evdevclass(int,char *,int,struct input_id *);
+int		evdevwanted(int,const char *,const struct input_id *);
+int		adddevrule(char,char *);
 void		closeevents(void);
 int		initfifo(char *);
-void		closefifo(void);
+void		*readlayout(char *);
+void		setlayout(void *);
+int		loadlayout(char *);
+int		watchlayout(char *);
+void		reloadlayout(int,char *,int);
 void		cleanup_stdin(void);
-int		add_filedescriptors(fd_set*);
-int		parse_events(fd_set*,int);
+int		evloop_add(int,int);
+void		evloop_mod(int,int,uint32_t);
+void		evloop_del(int);
+int		sendreport(int,const void*,int);
+int		flushreports(int);
+void		keyarray(unsigned char*,int,const unsigned char*);
+int		keyreport(void*,unsigned char,const unsigned char*);
+unsigned char	keybreportid(void);
+void		clearreports(void);
+void		setlastkeyb(const void *,int);
+int		idlereport(char,unsigned char,unsigned char *);
+int		currentreport(unsigned char,unsigned char *);
+int		ctlreply(int,const void *,int);
+int		outputreport(struct session_t *,const unsigned char *,int);
+void		setleds(unsigned char);
+void		writeleds(int,unsigned char);
+int		handlecontrol(struct session_t *);
+int		sessionopen(int,const char *);
+int		sessionpair(const char *);
+int		sessionfind(int);
+int		sessionnext(int);
+void		sessionclose(int);
+int		halfopen(void);
+void		switchfocus(int,char);
+int		sendrelease(int);
+void		requestfocus(void);
+void		sessionestablish(int,int);
+int		loadbonded(char *);
+void		savebonded(void);
+int		isbonded(const char *);
+void		bondhost(const char *);
+void		unbondhost(const char *);
+int		dialwait(void);
+void		dialready(int);
+void		dialfailed(const char *);
+void		dialcancel(void);
+int		parse_events(int,int);
+int		process_event(struct input_event*,int);
+int		flush_mouse(int);
+int		handle_event(struct evdev_t *,struct input_event *,int);
+void		recordevents(const struct input_event *,int);
+int		initrecord(char *);
+int		replay(char *,char *,char);
+void		writereport(const void *,int);
+int		spsc_init(struct spsc_t *,unsigned int,unsigned int);
+void		*spsc_slot(struct spsc_t *);
+void		spsc_push(struct spsc_t *);
+void		*spsc_peek(struct spsc_t *);
+void		spsc_pop(struct spsc_t *);
+void		spsc_sleep(struct spsc_t *,int,short,int);
+int		parsecpus(char *);
+void		pincpu(pthread_t,int);
+int		pipestart(void);
+void		pipestop(void);
+int		pipeevent(const struct input_event *);
+int		piperesync(void);
+void		pipelayout(void *);
+int		pipereport(const void *,int);
+void		pipeflushkeyb(void);
+void		pipesession(int,char,const struct hidrep_slot_t *,int);
+void		pipehandoff(int);
+void		pipenotify(void);
+void		piperequests(int);
+void		requestgrab(int);
+void		*translator(void *);
+void		*transmitter(void *);
+void		txreleased(int,const struct txhandoff_t *);
+int		keymodifier(int);
+int		neolayer(int);
+unsigned char	lookupkey(unsigned char,int,unsigned char *);
+int		resynckeys(int);
+void		heldkeys(unsigned long *);
+int		applykeys(const unsigned long *,int);
+uint64_t	nowstamp(void);
+int		latbucket(uint64_t);
+uint64_t	latvalue(int);
+void		latrecord(uint64_t);
+uint64_t	latsnapshot(uint64_t *);
+uint64_t	latpercentile(const uint64_t *,uint64_t,int);
+void		latprint(void);
+int		initstats(char *);
+void		servestats(int);
+int		writestats(int);
 void		showhelp(void);
 void		onsignal(int);
 
@@ -197,7 +508,7 @@ struct hidrep_mouse_t
 	unsigned char	button;	// bits 0..2 for left,right,middle, others 0
 	signed   char	axis_x; // relative movement in pixels, left/right
 	signed   char	axis_y; // dito, up/down
-	signed   char	axis_z; // Used for the scroll wheel (?)
+	signed   char	axis_z; // scroll wheel
 } __attribute((packed));
 // Keyboard HID report, as sent over the wire:
 struct hidrep_keyb_t
@@ -205,25 +516,193 @@ struct hidrep_keyb_t
 	unsigned char	btcode; // Fixed value for "Data Frame": 0xA1
 	unsigned char	rep_id; // Will be set to REPORTID_KEYBD for "keyboard"
 	unsigned char	modify; // Modifier keys (shift, alt, the like)
-	unsigned char	key[8]; // Currently pressed keys, max 8 at once
+	unsigned char	key[8]; // Pressed keys, all 0x01 if more than 8
+} __attribute((packed));
+// Keyboard HID report in N-key-rollover mode (-n), as sent over the wire:
+struct hidrep_nkro_t
+{
+	unsigned char	btcode; // Fixed value for "Data Frame": 0xA1
+	unsigned char	rep_id; // Will be set to REPORTID_KEYBD for "keyboard"
+	unsigned char	modify; // Modifier keys (shift, alt, the like)
+	unsigned char	bits[32]; // Currently pressed keys, bit per usage
+} __attribute((packed));
+// Boot protocol keyboard and mouse reports, as sent over the wire:
+struct hidrep_bootkeyb_t
+{
+	unsigned char	btcode; // Fixed value for "Data Frame": 0xA1
+	unsigned char	rep_id; // BOOTID_KEYBD
+	unsigned char	modify; // Modifier keys
+	unsigned char	reserved;
+	unsigned char	key[6]; // Pressed keys, all 0x01 if more than 6
+} __attribute((packed));
+struct hidrep_bootmouse_t
+{
+	unsigned char	btcode; // Fixed value for "Data Frame": 0xA1
+	unsigned char	rep_id; // BOOTID_MOUSE
+	unsigned char	button;	// bits 0..2 for left,right,middle
+	signed   char	axis_x; // no scroll wheel
+	signed   char	axis_y;
 } __attribute((packed));
+// An open event device (or the fifo), see evdev_add
+struct evdev_t
+{
+	char		used;		// entry holds an open descriptor
+	char		dropped;	// SYN_DROPPED seen, skipping to SYN_REPORT
+	char		grabbed;	// EVIOCGRAB held, see grabevents
+	int		num;		// EVDEVNAME number, -1 for the fifo
+	unsigned long	events;		// input_events read
+	int		class;		// EVCLASS_* bits
+	struct input_id	id;		// vendor/product (EVIOCGID)
+	char		name[80];	// EVIOCGNAME
+};
+// Include/exclude rule for event devices (-a/-r), see adddevrule
+struct devrule_t
+{
+	char		accept;		// 1: -a, 0: -r
+	int		vendor;		// -1 matches any
+	int		product;	// -1 matches any
+	char		*name;		// substring of the name, or NULL
+};
+// Transport for the control and interrupt channels, see bttransport:
+// Bluetooth L2CAP, or Unix domain sockets to run without an adapter (-u)
+struct transport_t
+{
+	const char	*name;
+	// Listening socket for channel psm (PSMHIDCTL/PSMHIDINT) at addr,
+	// non-blocking; <0 on error
+	int		(*listen)(const char *addr, unsigned short psm);
+	// Accept a connection on listening socket fd, describing the peer
+	// in peer[len]; <0 on error (errno set)
+	int		(*accept)(int fd, char *peer, int len);
+	// Remove what listen left behind
+	void		(*cleanup)(const char *addr, unsigned short psm);
+	// Start connecting to channel psm of the host at addr, without
+	// waiting: the socket becomes writable when done; <0 on error
+	int		(*connect)(const char *addr, unsigned short psm);
+	char		bonding;	// accept's peer is an addr for connect
+};
+// A report waiting in the queue for the interrupt channel
+struct hidrep_slot_t
+{
+	int		len;
+	uint64_t	stamp;		// event time for -t, see latrecord
+	unsigned char	data[REPMAXLEN];
+};
+// A change of the host the transmitter sends to (-p), see pipesession
+struct txhandoff_t
+{
+	int		sock;		// connection from now on, -1 for none
+	int		nrelease;	// reports in release[]
+	struct hidrep_slot_t	release[2];	// for the previous host, see
+						// switchfocus
+};
+// A connected host, see sessionopen. Only the one with the focus gets
+// the input; the others keep their connection and are answered on the
+// control channel
+struct session_t
+{
+	int		sctl;		// control channel, -1 if unused
+	int		sint;		// interrupt channel, -1 until there
+	char		peer[40];	// description of the host
+	uint64_t	since;		// nowstamp when sctl was accepted
+	char		protocol;	// HIDP_PROTO_*, see SET_PROTOCOL
+	unsigned char	idlerate;	// SET_IDLE, in units of 4 ms
+	unsigned char	leds;		// LED output report
+	char		dialed;		// we connected, see dialready
+	char		linklost;	// link failed, see sessionclose
+	int		nrelease;	// reports in release[] not sent yet
+	struct hidrep_slot_t	release[2];	// all keys and buttons
+						// released, see switchfocus
+};
 
 //***************** Global variables
 char		prepareshutdown	 = 0;	// Set if shutdown was requested
-int		eventdevs[MAXEVDEVS];	// file descriptors
-int		x11handles[MAXEVDEVS];
+struct evdev_t	*evdevs		 = NULL;	// open event devices, indexed by fd
+int		evdevslen	 = 0;	// allocated entries in evdevs[]
+int		nevdevs		 = 0;	// number of open event devices
+struct devrule_t *devrules	 = NULL;	// -a/-r rules, in command line order
+int		ndevrules	 = 0;
+char		haveaccept	 = 0;	// set if there is an -a rule
+int		evdevonly	 = -1;	// only use this EVDEVNAME number (-e)
 char		mousebuttons	 = 0;	// storage for button status
+int		mousedx		 = 0;	// motion collected until SYN_REPORT
+int		mousedy		 = 0;
+int		mousedz		 = 0;	// scroll wheel
+char		mousedirty	 = 0;	// set if a mouse report is pending
 int 		modifierkeys	 = 0;	// and for shift/ctrl/alt... status
-char		pressedkey[8]	 = { 0, 0, 0, 0,  0, 0, 0, 0 };
+unsigned char	maskedmods	 = 0;	// modifiers held when the input
+					// moved here (LAlt of LAlt+PRINT),
+					// not sent until released
+unsigned char	pressedbits[32]	 = { 0 };	// pressed keys, bit per usage
+char		nkro		 = 0;	// N-key-rollover report (-n)
 char		connectionok	 = 0;
 uint32_t	sdphandle	 = 0;	// To be used to "unregister" on exit
+int		evloopfd	 = -1;	// epoll instance of the main loop
+struct hidrep_slot_t	repqueue[REPQUEUELEN];	// ring of pending reports
+unsigned int	repqhead	 = 0;	// oldest pending report
+unsigned int	repqcount	 = 0;	// number of pending reports
+struct hidrep_slot_t	repkeyblatest;	// newest keyboard report that found
+					// the queue full, len 0 if none
+unsigned int	repdropped	 = 0;	// reports dropped on a full queue
+					// (atomic, see statsent)
+struct hidrep_slot_t	replastkeyb;	// last keyboard report sent/queued
+unsigned int	replastseq	 = 0;	// odd while replastkeyb changes,
+					// see setlastkeyb
+char		protocolmode	 = HIDP_PROTO_REPORT;	// of the focused host
+unsigned char	hostleds	 = 0;	// LEDs shown, see setleds
+struct session_t	sessions[MAXHOSTS];	// connected hosts
+int		focus		 = -1;	// session getting the input
+int		focusrequest	 = 0;	// LAlt+PRINT seen, see requestfocus
+char		*bondname	 = NULL;	// file of known hosts (-b)
+char		bonded[MAXBONDED][40];	// known hosts, last connected first
+int		nbonded		 = 0;
+char		dialpeer[40]	 = "";	// host to dial back, "" if none
+uint64_t	dialat		 = 0;	// nowstamp of the next attempt
+int		dialbackoff	 = 0;	// wait after the next failure (ms)
+int		dialfd		 = -1;	// channel being connected
+int		dialsession	 = -1;	// its session, once sctl is there
 int		debugevents      = 0;	// bitmask for debugging event data
-
-char	*result = NULL;
+char		timing		 = 0;	// measure latency per report (-t)
+uint64_t	evstamp		 = 0;	// time of the event being handled
+uint64_t	latcounts[LATBUCKETS];	// latency histogram, see latrecord
+uint64_t	latmax		 = 0;	// highest latency seen
+volatile sig_atomic_t	dumplatency = 0;	// SIGUSR1: print histogram
+// Counters for the statistics socket (-S), see writestats. The pipeline
+// threads (-p) count as well, so the send counters are updated atomically
+unsigned long	statsent	 = 0;	// reports sent
+unsigned long	statbytes	 = 0;	// bytes of reports sent
+unsigned long	statsenderr	 = 0;	// failed send() calls
+unsigned long	stateagain	 = 0;	// send() found the channel congested
+unsigned long	statconns	 = 0;	// connections established
+unsigned long	statresyncs	 = 0;	// key state resynchronizations
+time_t		statstart	 = 0;	// time hidclient started
+FILE		*recfile	 = NULL;	// recording of input events (-R)
+FILE		*repout		 = NULL;	// replay (-P): reports go here
+const struct transport_t	bttransport =
+		{ "Bluetooth", bt_listen, bt_accept, bt_cleanup, bt_connect, 1 };
+const struct transport_t	unixtransport =
+		{ "Unix socket", unix_listen, unix_accept, unix_cleanup,
+		  unix_connect, 0 };
+const struct transport_t	*transport = &bttransport;	// -u changes it
+char		*transaddr	 = NULL;	// -u: path of the sockets
+char		pipelined	 = 0;	// reader/translator/transmitter (-p)
+int		pipecpus[3]	 = { -1, -1, -1 };	// and their CPUs
+struct spsc_t	evring;			// reader -> translator: input_events
+struct spsc_t	repring;		// translator -> transmitter: reports
+pthread_t	pipethreads[2];		// translator, transmitter
+int		pipenotifyfd	 = -1;	// eventfd: threads -> main loop
+struct txhandoff_t	txhandoffs[TXHANDOFFS];	// see pipesession
+unsigned int	txhandoffseq	 = 0;	// next entry to use (main thread)
+unsigned int	txpending	 = 0;	// entries the transmitter has not
+					// reached yet
+int		grabrequest	 = -1;	// grabevents() wanted by translator
+char		txbroken	 = 0;	// transmitter found connection broken
+char		pipestopping	 = 0;	// shutdown: do not wait for the radio
+struct hidrep_slot_t	pipekeyb;	// newest keyboard report that found
+					// repring full (translator only)
 
 unsigned char stop_writing = 0; //stop writing on computer when writing on external device
 unsigned char on = 0; //is "stop writing" actually on or off
-unsigned char id = 0; //id of keyboard to stop writing
 
 extern unsigned char pass[ARRAY][2];
 
@@ -349,6 +828,177 @@ unsigned char chars[100][6][2] = {
   {{0x00,0x36},{0x00,0x00},{0x00,0x00},{0x00,0x00},{0x00,0x00},{0x00,0x00}}  //99 0x63 - US: KPDOT     , DE: NB Punkt  , Layer 1: ,         , Layer 2:           , Layer 3:           , Layer 4:
 };
 
+/* Linux keycode -> HID keyboard usage. The usage is also the row of chars[]
+ * used for that key, so KEYMAP_CHARS must stay in line with the row
+ * comments of the chars table above. That is kept by hand: the compile
+ * time checks below only make sure each usage has a row in chars[] (and
+ * that the extra keys below have none), not that it is the right row.
+ * Neo modifiers (CapsLock, #, <, RightAlt) and the real modifiers are no
+ * regular keys and map to usage 0.
+ */
+#define	KEYMAP_CHARS(X) \
+	X ( KEY_A,		0x04 ) \
+	X ( KEY_B,		0x05 ) \
+	X ( KEY_C,		0x06 ) \
+	X ( KEY_D,		0x07 ) \
+	X ( KEY_E,		0x08 ) \
+	X ( KEY_F,		0x09 ) \
+	X ( KEY_G,		0x0A ) \
+	X ( KEY_H,		0x0B ) \
+	X ( KEY_I,		0x0C ) \
+	X ( KEY_J,		0x0D ) \
+	X ( KEY_K,		0x0E ) \
+	X ( KEY_L,		0x0F ) \
+	X ( KEY_M,		0x10 ) \
+	X ( KEY_N,		0x11 ) \
+	X ( KEY_O,		0x12 ) \
+	X ( KEY_P,		0x13 ) \
+	X ( KEY_Q,		0x14 ) \
+	X ( KEY_R,		0x15 ) \
+	X ( KEY_S,		0x16 ) \
+	X ( KEY_T,		0x17 ) \
+	X ( KEY_U,		0x18 ) \
+	X ( KEY_V,		0x19 ) \
+	X ( KEY_W,		0x1A ) \
+	X ( KEY_X,		0x1B ) \
+	X ( KEY_Y,		0x1C ) \
+	X ( KEY_Z,		0x1D ) \
+	X ( KEY_1,		0x1E ) \
+	X ( KEY_2,		0x1F ) \
+	X ( KEY_3,		0x20 ) \
+	X ( KEY_4,		0x21 ) \
+	X ( KEY_5,		0x22 ) \
+	X ( KEY_6,		0x23 ) \
+	X ( KEY_7,		0x24 ) \
+	X ( KEY_8,		0x25 ) \
+	X ( KEY_9,		0x26 ) \
+	X ( KEY_0,		0x27 ) \
+	X ( KEY_ENTER,		0x28 ) \
+	X ( KEY_ESC,		0x29 ) \
+	X ( KEY_BACKSPACE,	0x2A ) \
+	X ( KEY_TAB,		0x2B ) \
+	X ( KEY_SPACE,		0x2C ) \
+	X ( KEY_MINUS,		0x2D ) \
+	X ( KEY_EQUAL,		0x2E ) \
+	X ( KEY_LEFTBRACE,	0x2F ) \
+	X ( KEY_RIGHTBRACE,	0x30 ) \
+	X ( KEY_SEMICOLON,	0x33 ) \
+	X ( KEY_APOSTROPHE,	0x34 ) \
+	X ( KEY_GRAVE,		0x35 ) \
+	X ( KEY_COMMA,		0x36 ) \
+	X ( KEY_DOT,		0x37 ) \
+	X ( KEY_SLASH,		0x38 ) \
+	X ( KEY_F1,		0x3A ) \
+	X ( KEY_F2,		0x3B ) \
+	X ( KEY_F3,		0x3C ) \
+	X ( KEY_F4,		0x3D ) \
+	X ( KEY_F5,		0x3E ) \
+	X ( KEY_F6,		0x3F ) \
+	X ( KEY_F7,		0x40 ) \
+	X ( KEY_F8,		0x41 ) \
+	X ( KEY_F9,		0x42 ) \
+	X ( KEY_F10,		0x43 ) \
+	X ( KEY_F11,		0x44 ) \
+	X ( KEY_F12,		0x45 ) \
+	X ( KEY_SCROLLLOCK,	0x47 ) \
+	X ( KEY_PAUSE,		0x48 ) \
+	X ( KEY_INSERT,		0x49 ) \
+	X ( KEY_HOME,		0x4A ) \
+	X ( KEY_PAGEUP,		0x4B ) \
+	X ( KEY_DELETE,		0x4C ) \
+	X ( KEY_END,		0x4D ) \
+	X ( KEY_PAGEDOWN,	0x4E ) \
+	X ( KEY_RIGHT,		0x4F ) \
+	X ( KEY_LEFT,		0x50 ) \
+	X ( KEY_DOWN,		0x51 ) \
+	X ( KEY_UP,		0x52 ) \
+	X ( KEY_NUMLOCK,	0x53 ) \
+	X ( KEY_KPSLASH,	0x54 ) \
+	X ( KEY_KPASTERISK,	0x55 ) \
+	X ( KEY_KPMINUS,	0x56 ) \
+	X ( KEY_KPPLUS,		0x57 ) \
+	X ( KEY_KPENTER,	0x58 ) \
+	X ( KEY_KP1,		0x59 ) \
+	X ( KEY_KP2,		0x5A ) \
+	X ( KEY_KP3,		0x5B ) \
+	X ( KEY_KP4,		0x5C ) \
+	X ( KEY_KP5,		0x5D ) \
+	X ( KEY_KP6,		0x5E ) \
+	X ( KEY_KP7,		0x5F ) \
+	X ( KEY_KP8,		0x60 ) \
+	X ( KEY_KP9,		0x61 ) \
+	X ( KEY_KP0,		0x62 ) \
+	X ( KEY_KPDOT,		0x63 )
+
+/* Keys beyond the chars table: sent with their usage on every layer */
+#define	KEYMAP_EXTRA(X) \
+	X ( KEY_COMPOSE,	0x65 ) \
+	X ( KEY_POWER,		0x66 ) \
+	X ( KEY_KPEQUAL,	0x67 ) \
+	X ( KEY_F13,		0x68 ) \
+	X ( KEY_F14,		0x69 ) \
+	X ( KEY_F15,		0x6A ) \
+	X ( KEY_F16,		0x6B ) \
+	X ( KEY_F17,		0x6C ) \
+	X ( KEY_F18,		0x6D ) \
+	X ( KEY_F19,		0x6E ) \
+	X ( KEY_F20,		0x6F ) \
+	X ( KEY_F21,		0x70 ) \
+	X ( KEY_F22,		0x71 ) \
+	X ( KEY_F23,		0x72 ) \
+	X ( KEY_F24,		0x73 ) \
+	X ( KEY_OPEN,		0x74 ) \
+	X ( KEY_HELP,		0x75 ) \
+	X ( KEY_PROPS,		0x76 ) \
+	X ( KEY_FRONT,		0x77 ) \
+	X ( KEY_STOP,		0x78 ) \
+	X ( KEY_AGAIN,		0x79 ) \
+	X ( KEY_UNDO,		0x7A ) \
+	X ( KEY_CUT,		0x7B ) \
+	X ( KEY_COPY,		0x7C ) \
+	X ( KEY_PASTE,		0x7D ) \
+	X ( KEY_FIND,		0x7E ) \
+	X ( KEY_MUTE,		0x7F ) \
+	X ( KEY_VOLUMEUP,	0x80 ) \
+	X ( KEY_VOLUMEDOWN,	0x81 ) \
+	X ( KEY_KPCOMMA,	0x85 ) \
+	X ( KEY_RO,		0x87 ) \
+	X ( KEY_KATAKANAHIRAGANA,	0x88 ) \
+	X ( KEY_YEN,		0x89 ) \
+	X ( KEY_HENKAN,		0x8A ) \
+	X ( KEY_MUHENKAN,	0x8B ) \
+	X ( KEY_KPJPCOMMA,	0x8C ) \
+	X ( KEY_HANGEUL,	0x90 ) \
+	X ( KEY_HANJA,		0x91 ) \
+	X ( KEY_KATAKANA,	0x92 ) \
+	X ( KEY_HIRAGANA,	0x93 ) \
+	X ( KEY_ZENKAKUHANKAKU,	0x94 )
+
+#define	NCHARS		( sizeof(chars) / sizeof(chars[0]) )
+#define	KEYUSAGE_INIT(code,usage)	[code] = usage,
+#define	KEYUSAGE_CHARS(code,usage)	_Static_assert ( (usage) < NCHARS, \
+		#code " has no row in chars[]" );
+#define	KEYUSAGE_EXTRA(code,usage)	_Static_assert ( (usage) >= NCHARS, \
+		#code " would shadow a row of chars[]" );
+_Static_assert ( NCHARS == 100, "KEYMAP_CHARS expects 100 rows in chars[]" );
+KEYMAP_CHARS(KEYUSAGE_CHARS)
+KEYMAP_EXTRA(KEYUSAGE_EXTRA)
+
+// Translation table: keyusage[inevent->code] for any code up to KEY_MAX
+const unsigned char keyusage[KEY_MAX+1] = {
+	KEYMAP_CHARS(KEYUSAGE_INIT)
+	KEYMAP_EXTRA(KEYUSAGE_INIT)
+};
+
+// Active layout: layoutrows x layoutlayers pairs of {modifier, key},
+// either the chars table above or a copy of the layout file given with -k
+const unsigned char	*layouttab	= &chars[0][0][0];
+unsigned int		layoutrows	= NCHARS;
+unsigned int		layoutlayers	= sizeof(chars[0]) / sizeof(chars[0][0]);
+void			*layoutbuf	= NULL;	// the copy, see readlayout
+void			*layoutnext	= NULL;	// -p: not taken over yet
+char			*layoutbase	= NULL;	// its name, for the inotify watch
+
 
 
 //***************** Implementation
@@ -436,7 +1086,7 @@ int	dosdpregistration ( void )
 			// Assigned to SDP 0x200...0x205 - see HID SPEC for
 			// details. Those values seem to work fine...
 			// "it\'s a kind of magic" numbers.
-			hid_attr2[]={0x100, 0x0};
+			hid_attr2[]={0x100, 0x1};	// boot device
 
 	// Connect to SDP server on localhost, to publish service information
 	session = sdp_connect ( BDADDR_ANY, BDADDR_LOCAL, 0 );
@@ -508,9 +1158,9 @@ int	dosdpregistration ( void )
         values[0] = &hid_spec_type;
 	dtd_data= SDPRECORD_BYTES <= 255 ? SDP_TEXT_STR8 : SDP_TEXT_STR16 ;
         dtds[1] = &dtd_data;
-        values[1] = (uint8_t *) SDPRECORD;
+        values[1] = (uint8_t *) ( nkro ? SDPRECORD_NKRO : SDPRECORD );
         leng[0] = 0;
-        leng[1] = SDPRECORD_BYTES;
+        leng[1] = nkro ? SDPRECORD_NKRO_BYTES : SDPRECORD_BYTES;
         hid_spec_lst = sdp_seq_alloc_with_length(dtds, values, leng, 2);
         hid_spec_lst2 = sdp_data_alloc(SDP_SEQ8, hid_spec_lst);
         sdp_attr_add(&record, SDP_ATTR_HID_DESCRIPTOR_LIST, hid_spec_lst2);
@@ -525,7 +1175,7 @@ int	dosdpregistration ( void )
 	sdp_attr_add_new ( &record, SDP_ATTR_HID_PROFILE_VERSION,
 			SDP_UINT16, &hid_attr2[0] );
 	sdp_attr_add_new ( &record, SDP_ATTR_HID_BOOT_DEVICE,
-			SDP_UINT16, &hid_attr2[1] );
+			SDP_BOOL, &hid_attr2[1] );
 	// Submit our IDEA of a SDP record to the "sdpd"
         if (sdp_record_register(session, &record, SDP_RECORD_PERSIST) < 0) {
                 fprintf ( stderr, "Service Record registration failed\n" );
@@ -595,6 +1245,166 @@ int	btbind ( int sockfd, unsigned short port ) {
 }
 
 
+/*
+ *	bt_listen (addr, psm) - Bluetooth transport: listen on L2CAP PSM psm
+ *	of any local adapter (addr unused)
+ */
+int	bt_listen ( const char *addr, unsigned short psm )
+{
+	int	fd;
+	fd = socket ( AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK,
+			BTPROTO_L2CAP );
+	if ( 0 > fd )
+	{
+		fprintf ( stderr, "Failed to generate bluetooth socket\n" );
+		return	-1;
+	}
+	if ( btbind ( fd, psm ) || listen ( fd, MAXHOSTS ) )
+	{
+		fprintf ( stderr, "Failed to listen on PSM %d\n", psm );
+		close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+// Bluetooth transport: accept a connection, peer is the host's address
+int	bt_accept ( int fd, char *peer, int len )
+{
+	struct sockaddr_l2	l2a;
+	socklen_t		alen = sizeof(l2a);
+	char			badr[18];
+	if ( 0 > ( fd = accept ( fd, (struct sockaddr *)&l2a, &alen ) ) )
+		return	-1;
+	ba2str ( &l2a.l2_bdaddr, badr );
+	snprintf ( peer, len, "%s", badr );
+	return	fd;
+}
+
+void	bt_cleanup ( const char *addr, unsigned short psm )
+{
+	return;
+}
+
+// Bluetooth transport: connect to L2CAP PSM psm of the host with address addr
+int	bt_connect ( const char *addr, unsigned short psm )
+{
+	struct sockaddr_l2	l2a;
+	int	fd;
+	memset ( &l2a, 0, sizeof(l2a) );
+	l2a.l2_family = AF_BLUETOOTH;
+	l2a.l2_psm = htobs ( psm );
+	if ( 0 > str2ba ( addr, &l2a.l2_bdaddr ) )
+	{
+		errno = EINVAL;
+		return	-1;
+	}
+	if ( 0 > ( fd = socket ( AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK,
+			BTPROTO_L2CAP ) ) )
+		return	-1;
+	if ( ( 0 > connect ( fd, (struct sockaddr *)&l2a, sizeof(l2a) ) ) &&
+	     ( errno != EINPROGRESS ) )
+	{
+		close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+/*
+ *	unix_path (sun, addr, psm) - Unix socket transport: the channels
+ *	are SOCK_SEQPACKET sockets addr.ctl and addr.int, like the L2CAP
+ *	channels. Fills in sun, returns <0 if the name is too long
+ */
+int	unix_path ( struct sockaddr_un *sun, const char *addr, unsigned short psm )
+{
+	memset ( sun, 0, sizeof(*sun) );
+	sun->sun_family = AF_UNIX;
+	if ( sizeof(sun->sun_path) <= snprintf ( sun->sun_path,
+			sizeof(sun->sun_path), "%s.%s", addr,
+			psm == PSMHIDCTL ? "ctl" : "int" ) )
+	{
+		fprintf ( stderr, "Socket name [%s] too long\n", addr );
+		return	-1;
+	}
+	return	0;
+}
+
+int	unix_listen ( const char *addr, unsigned short psm )
+{
+	struct sockaddr_un	sun;
+	int	fd;
+	if ( 0 > unix_path ( &sun, addr, psm ) ) return -1;
+	unlink ( sun.sun_path );
+	if ( ( 0 > ( fd = socket ( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+				SOCK_CLOEXEC, 0 ) ) ) ||
+	     ( 0 > bind ( fd, (struct sockaddr *)&sun, sizeof(sun) ) ) ||
+	     ( 0 > listen ( fd, MAXHOSTS ) ) )
+	{
+		fprintf ( stderr, "Failed to listen on [%s]: %s\n",
+				sun.sun_path, strerror ( errno ) );
+		if ( fd >= 0 ) close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+int	unix_accept ( int fd, char *peer, int len )
+{
+	if ( 0 > ( fd = accept4 ( fd, NULL, NULL, SOCK_CLOEXEC ) ) )
+		return	-1;
+	snprintf ( peer, len, "local host" );
+	return	fd;
+}
+
+void	unix_cleanup ( const char *addr, unsigned short psm )
+{
+	struct sockaddr_un	sun;
+	if ( 0 == unix_path ( &sun, addr, psm ) ) unlink ( sun.sun_path );
+	return;
+}
+
+// Unix socket transport: connect to a host listening on addr (hidhost -l)
+int	unix_connect ( const char *addr, unsigned short psm )
+{
+	struct sockaddr_un	sun;
+	int	fd;
+	if ( 0 > unix_path ( &sun, addr, psm ) )
+	{
+		errno = ENAMETOOLONG;
+		return	-1;
+	}
+	if ( 0 > ( fd = socket ( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+				SOCK_CLOEXEC, 0 ) ) )
+		return	-1;
+	if ( ( 0 > connect ( fd, (struct sockaddr *)&sun, sizeof(sun) ) ) &&
+	     ( errno != EINPROGRESS ) && ( errno != EAGAIN ) )
+	{
+		close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+/*
+ *	acceptchannel (fd, what, peer, len) - accept a connection on the
+ *	listening socket fd of channel what, see transport_t.accept.
+ *	Returns the connected socket, <0 if there is none
+ */
+int	acceptchannel ( int fd, const char *what, char *peer, int len )
+{
+	if ( 0 > ( fd = transport->accept ( fd, peer, len ) ) )
+	{
+		if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) )
+		{
+			fprintf ( stderr, "Failed to get %s connection: %s\n",
+					what, strerror ( errno ) );
+		}
+		return	-1;
+	}
+	return	fd;
+}
+
 /*
  *	initfifo(filename) - creates (if necessary) and opens fifo
  *	instead of event devices. If filename exists and is NOT a fifo,
@@ -603,6 +1413,7 @@ int	btbind ( int sockfd, unsigned short port ) {
 int	initfifo ( char *filename )
 {
 	struct stat ss;
+	int	fd;
 	if ( NULL == filename ) return 0;
 	if ( 0 == stat ( filename, &ss ) )
 	{
@@ -618,258 +1429,2816 @@ int	initfifo ( char *filename )
 			return 0;
 		}
 	}
-	eventdevs[0] = open ( filename, O_RDONLY | O_NONBLOCK );
-	if ( 0 > eventdevs[0] )
+	// Opened read-write, so the fifo never reports EOF/hangup to the
+	// event loop when a writer goes away
+	fd = open ( filename, O_RDWR | O_NONBLOCK );
+	if ( 0 > fd )
 	{
 		fprintf ( stderr, "Failed to open fifo [%s] for reading.\n", filename );
 		return 0;
 	}
+	if ( NULL == evdev_add ( fd, -1 ) )
+	{
+		close ( fd );
+		return 0;
+	}
 	return	1;
 }
 
 /*
- * 	initevents () - opens all required event files
- * 	or only one device, if number useonlyone is >= 0
- *	try to disable in X11 if mutex11 is set to 1
- * 	returns number of successfully opened event file nodes, or <1 for error
+ *	readlayout(filename) - reads a binary layout file built by mklayout
+ *	into memory and checks it. It is copied rather than mapped: a file
+ *	rewritten in place (cp, an editor) would take a mapping away under
+ *	lookupkey. Returns the copy (header and table, to be given to
+ *	setlayout), NULL on failure
  */
-int	initevents ( int useonlyone, int mutex11 )
+void	*readlayout ( char *filename )
 {
-	int	i, j, k;
-	char	buf[sizeof(EVDEVNAME)+8];
-	char	*xinlist = NULL;
-	FILE	*pf;
-	char	*p, *q;
-	if ( mutex11 )
+	struct stat	ss;
+	const struct layout_header	*hdr;
+	char		*buf;
+	int		fd, j;
+	size_t		len;
+	unsigned int	rows, layers;
+	if ( 0 > ( fd = open ( filename, O_RDONLY ) ) )
 	{
-		if ( NULL == ( xinlist = malloc ( 4096 ) ) )
-		{
-			printf ( "Memory alloc error\n" );
-			return 0;
-		}
-		bzero ( xinlist, 4096 );
-		if ( NULL != ( pf = popen ("xinput --list --short", "r" ) ) )
-		{
-			if ( 1 > fread ( xinlist, 1, 3800, pf ) )
-			{
-				printf ( "\tx11-mutable information not available.\n" );
-				free ( xinlist );
-				xinlist = NULL;
-			}
-		}
-		fclose ( pf );
+		fprintf ( stderr, "Failed to open layout [%s]: %s\n",
+				filename, strerror ( errno ) );
+		return	NULL;
 	}
-	for ( i = 0; i < MAXEVDEVS; ++i )
+	if ( ( 0 != fstat ( fd, &ss ) ) ||
+	     ( ss.st_size < sizeof(struct layout_header) ) ||
+	     ( ss.st_size > LAYOUT_BYTES ( LAYOUT_MAXROWS, LAYOUT_MAXLAYERS ) ) ||
+	     ( NULL == ( buf = malloc ( ss.st_size ) ) ) )
 	{
-		eventdevs[i] = -1;
-		x11handles[i] = -1;
+		fprintf ( stderr, "Layout [%s] has an invalid size.\n", filename );
+		close ( fd );
+		return	NULL;
 	}
-	for ( i = j = 0; j < MAXEVDEVS; ++j )
+	for ( len = 0; len < ss.st_size; len += j )
 	{
-		if ( ( useonlyone >= 0 ) && ( useonlyone != j ) ) { continue; }
-		sprintf ( buf, EVDEVNAME, j );
-		eventdevs[i] = open ( buf, O_RDONLY );
-		if ( 0 <= eventdevs[i] )
-		{
-			fprintf ( stdout, "Opened %s as event device [counter %d]\n", buf, i );
-			if ( ( mutex11 > 0 ) && ( xinlist != NULL ) )
-			{
-				k = -1;
-				xinlist[3801] = 0;
-				if ( ioctl(eventdevs[i], EVIOCGNAME(256),xinlist+3801) >= 0 )
-				{
-					p = xinlist;
-					xinlist[4056] = 0;
-					if ( strlen(xinlist+3801) < 4 ) // min lenght for name
-						p = xinlist + 4056;
-					while ( (*p != 0) &&
-						( NULL != ( p = strstr ( p, xinlist+3801 ) ) ) )
-					{
-						q = p + strlen(xinlist+3801);
-						while ( *q == ' ' ) ++q;
-						if ( strncmp ( q, "\tid=", 4 ) == 0 )
-						{
-							k = atoi ( q + 4 );
-							p = xinlist + 4056;
-						} else {
-							p = q;
-						}
-					}
-				}
-				if ( k >= 0 ) {
-					//sprintf ( xinlist+3801, "xinput set-int-prop %d \"Device Enabled\" 8 0", k );
-                    id = k;
-					//if ( system ( xinlist + 3801 ) )
-					//{
-					//	fprintf ( stderr, "Failed to x11-mute.\n" );
-					//}
-					//x11handles[i] = k;
-				}
-			}
-			++i;
-		}
+		if ( 0 >= ( j = read ( fd, buf + len, ss.st_size - len ) ) )
+			break;
 	}
-	if ( xinlist != NULL ) { free ( xinlist ); }
-	return	i;
+	close ( fd );
+	hdr = (const struct layout_header *)buf;
+	rows = le16toh ( hdr->rows );
+	layers = le16toh ( hdr->layers );
+	if ( ( len != ss.st_size ) ||
+	     ( 0 != memcmp ( hdr->magic, LAYOUT_MAGIC, sizeof(hdr->magic) ) ) ||
+	     ( LAYOUT_VERSION != le16toh ( hdr->version ) ) ||
+	     ( rows > LAYOUT_MAXROWS ) || ( layers < 1 ) ||
+	     ( layers > LAYOUT_MAXLAYERS ) ||
+	     ( ss.st_size != LAYOUT_BYTES ( rows, layers ) ) )
+	{
+		fprintf ( stderr, "File [%s] is no valid layout (version %d)."
+				"\n", filename, LAYOUT_VERSION );
+		free ( buf );
+		return	NULL;
+	}
+	fprintf ( stdout, "Using layout [%s]: %u keys, %u layers\n",
+			filename, rows, layers );
+	return	buf;
 }
 
-void	closeevents ( void )
+/*
+ *	setlayout(buf) - makes the layout read by readlayout the active one,
+ *	and frees the previous. Only where the key state is kept, between
+ *	two input frames, so no frame sees a mix of both layouts
+ */
+void	setlayout ( void * buf )
 {
-	int	i;
-	char	buf[256];
-	for ( i = 0; i < MAXEVDEVS; ++i )
+	const struct layout_header	*hdr = buf;
+	free ( layoutbuf );
+	layoutbuf = buf;
+	layouttab = (const unsigned char *)( hdr + 1 );
+	layoutrows = le16toh ( hdr->rows );
+	layoutlayers = le16toh ( hdr->layers );
+	return;
+}
+
+// Load the layout file at start (-k): 1 on success, 0 on failure
+int	loadlayout ( char *filename )
+{
+	void	*buf;
+	if ( NULL == ( buf = readlayout ( filename ) ) )
+		return	0;
+	setlayout ( buf );
+	return	1;
+}
+
+/*
+ *	watchlayout(filename) - watch the directory of the layout file, so
+ *	a rebuilt layout (mklayout renames it into place) can be picked up
+ *	while running. Returns the inotify descriptor, or <0 on failure
+ */
+int	watchlayout ( char *filename )
+{
+	int	fd;
+	char	*dir;
+	if ( 0 > ( fd = inotify_init1 ( IN_NONBLOCK | IN_CLOEXEC ) ) )
+	{
+		fprintf ( stderr, "Failed to watch layout [%s]: %s\n",
+				filename, strerror ( errno ) );
+		return	-1;
+	}
+	// dirname/basename may modify their argument
+	dir = strdup ( filename );
+	layoutbase = strdup ( filename );
+	if ( ( dir == NULL ) || ( layoutbase == NULL ) ||
+	     ( 0 > inotify_add_watch ( fd, dirname ( dir ),
+				IN_CLOSE_WRITE | IN_MOVED_TO ) ) )
+	{
+		fprintf ( stderr, "Failed to watch layout [%s]: %s\n",
+				filename, strerror ( errno ) );
+		free ( dir );
+		close ( fd );
+		return	-1;
+	}
+	layoutbase = basename ( layoutbase );
+	free ( dir );
+	return	fd;
+}
+
+/*
+ *	reloadlayout(fd, filename, sockdesc) - the watched directory changed:
+ *	load the layout again if its file was rewritten. The connection is
+ *	left alone, keys held are looked up again in the new layout (a key
+ *	released later must clear the usage it was reported with), a broken
+ *	file keeps the active layout.
+ */
+void	reloadlayout ( int fd, char *filename, int sockdesc )
+{
+	void	*layout;
+	char	buf[4096] __attribute((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event	*ev;
+	char	changed = 0;
+	int	j;
+	while ( 0 < ( j = read ( fd, buf, sizeof(buf) ) ) )
 	{
-		if ( eventdevs[i] >= 0 )
+		for ( ev = (void *)buf; (char *)ev < buf + j;
+			ev = (void *)( (char *)ev + sizeof(*ev) + ev->len ) )
 		{
-			close ( eventdevs[i] );
-			if ( x11handles[i] >= 0 )
+			if ( ( ev->len > 0 ) &&
+			     ( 0 == strcmp ( ev->name, layoutbase ) ) )
 			{
-				sprintf ( buf, "xinput set-int-prop %d \"Device "\
-				"Enabled\" 8 1", x11handles[i] );
-				if ( system ( buf ) )
-				{
-					fprintf ( stderr, "Failed to x11-unmute device %d.\n", i );
-				}
+				changed = 1;
 			}
 		}
 	}
+	if ( changed )
+	{
+		fprintf ( stdout, "Layout [%s] changed, reloading.\n", filename );
+		if ( NULL == ( layout = readlayout ( filename ) ) )
+			return;
+		if ( pipelined )
+		{	// The translator uses the layout, it swaps it
+			pipelayout ( layout );
+			piperesync ();
+			return;
+		}
+		setlayout ( layout );
+		resynckeys ( sockdesc );
+	}
 	return;
 }
 
-void	closefifo ( void )
+/*
+ *	evdev_add (fd, num) - register open event device fd (EVDEVNAME number
+ *	num, -1 for the fifo). The registry is indexed by the descriptor,
+ *	so the event loop finds a device without searching, and grows as
+ *	needed: there is no limit on the number of devices.
+ *	Returns the entry, or NULL if out of memory
+ */
+struct evdev_t	*evdev_add ( int fd, int num )
 {
-	if ( eventdevs[0] >= 0 )
-		close(eventdevs[0]);
-	return;
+	struct evdev_t	*p;
+	int	len;
+	if ( fd >= evdevslen )
+	{
+		for ( len = evdevslen ? evdevslen : EVDEVSINIT; len <= fd; len *= 2 ) {;}
+		if ( NULL == ( p = realloc ( evdevs, len * sizeof(*p) ) ) )
+		{
+			fprintf ( stderr, "Memory alloc error\n" );
+			return	NULL;
+		}
+		memset ( p + evdevslen, 0, ( len - evdevslen ) * sizeof(*p) );
+		evdevs = p;
+		evdevslen = len;
+	}
+	p = &evdevs[fd];
+	memset ( p, 0, sizeof(*p) );
+	p->used = 1;
+	p->num = num;
+	++nevdevs;
+	return	p;
 }
 
-void	cleanup_stdin ( void )
+/*
+ *	evdev_del (fd) - remove fd from the registry (does not close it)
+ */
+void	evdev_del ( int fd )
 {
-	// Cleans everything but the characters after the last ENTER keypress.
-	// This is necessary BECAUSE while reading all keyboard input from the
-	// event devices, those key presses will still stay in the stdin queue.
-	// We do not want to have a backlog of hundreds of characters, possibly
-	// commands and so on.
-	fd_set fds;
-	struct timeval tv;
-	FD_ZERO ( &fds );
-	FD_SET ( 0, &fds );
-	tv.tv_sec  = 0;
-	tv.tv_usec = 0;
-	char buf[8];
-	while ( 0 < select ( 1, &fds, NULL, NULL, &tv ) )
-	{
-		while ( read ( 0, buf, 8 ) ) {;}
-		FD_ZERO ( &fds );
-		FD_SET ( 0, &fds );
-		tv.tv_sec  = 0;
-		tv.tv_usec = 1;
-	}
-	close ( 0 );
+	if ( ( fd < 0 ) || ( fd >= evdevslen ) || ! evdevs[fd].used ) return;
+	evdevs[fd].used = 0;
+	--nevdevs;
 	return;
 }
 
-int	add_filedescriptors ( fd_set * fdsp )
+/*
+ * 	initevents () - opens all event devices found in EVDEVDIR
+ * 	or only one device, if number useonlyone is >= 0
+ * 	returns number of successfully opened event file nodes, or <1 for error
+ */
+int	initevents ( int useonlyone )
 {
-	// Simply add all open eventdev fds to the fd_set for select.
-	int	i, j;
-	FD_ZERO ( fdsp );
-	j = -1;
-	for ( i = 0; i < MAXEVDEVS; ++i )
+	DIR	*dir;
+	struct dirent	*de;
+	int	i, num;
+	evdevonly = useonlyone;
+	if ( NULL == ( dir = opendir ( EVDEVDIR ) ) )
 	{
-		if ( eventdevs[i] >= 0 )
-		{
-			FD_SET ( eventdevs[i], fdsp );
-			if ( eventdevs[i] > j )
-			{
-				j = eventdevs[i];
-			}
-		}
+		fprintf ( stderr, "Failed to read " EVDEVDIR ": %s\n",
+				strerror ( errno ) );
+		return	0;
 	}
-	return	j;
+	for ( i = 0; NULL != ( de = readdir ( dir ) ); )
+	{
+		if ( 1 != sscanf ( de->d_name, "event%d", &num ) ) { continue; }
+		if ( ( useonlyone >= 0 ) && ( useonlyone != num ) ) { continue; }
+		if ( 0 <= openevdev ( num ) ) { ++i; }
+	}
+	closedir ( dir );
+	return	i;
 }
 
 /*
- *	list_input_devices - Show a human-readable list of all input devices
- *	the current user has permissions to read from.
- *	Add info wether this probably can be "muted" in X11 if requested
+ *	openevdev (num) - open event device number num and add it to the
+ *	registry. Returns its file descriptor, or <0 if it cannot be
+ *	opened (yet)
  */
-int	list_input_devices ()
+int	openevdev ( int num )
 {
-	int	i, fd;
+	int	fd, class;
 	char	buf[sizeof(EVDEVNAME)+8];
-	struct input_id device_info;
-	char	namebuf[256];
-	char	*xinlist;
-	FILE	*pf;
-	char	*p, *q;
-	char	x11 = 0;
-	if ( NULL == ( xinlist = malloc ( 4096 ) ) )
+	char	name[sizeof(evdevs->name)];
+	struct input_id	id;
+	struct evdev_t	*ev;
+	sprintf ( buf, EVDEVNAME, num );
+	// Writable to set the LEDs of a keyboard, if permissions allow
+	fd = open ( buf, O_RDWR | O_NONBLOCK );
+	if ( ( 0 > fd ) &&
+	     ( 0 > ( fd = open ( buf, O_RDONLY | O_NONBLOCK ) ) ) )
 	{
-		printf ( "Memory alloc error\n" );
-		return	1;
+		return	-1;
 	}
-	bzero ( xinlist, 4096 );
-	if ( NULL != ( pf = popen ("xinput --list --name-only", "r" ) ) )
+	if ( timing )
+	{	// Same clock as nowstamp, for latrecord
+		class = CLOCK_MONOTONIC;
+		ioctl ( fd, EVIOCSCLOCKID, &class );
+	}
+	class = evdevclass ( fd, name, sizeof(name), &id );
+	if ( ( evdevonly < 0 ) && ! evdevwanted ( class, name, &id ) )
+	{	// Switches, accelerometers, ... or excluded by a rule
+		fprintf ( stdout, "Ignoring %s '%s'\n", buf, name );
+		close ( fd );
+		return	-1;
+	}
+	if ( NULL == ( ev = evdev_add ( fd, num ) ) )
 	{
-		if ( 1 > fread ( xinlist, 1, 4095, pf ) )
-		{
-			printf ( "\tx11-mutable information not available.\n" );
-		}
-		fclose ( pf );
+		close ( fd );
+		return	-1;
 	}
-	printf ( "List of available input devices:\n");
-	printf ( "num\tVendor/Product, Name, -x compatible (x/-)\n" );
-	for ( i = 0; i < MAXEVDEVS; ++i )
+	ev->class = class;
+	ev->id = id;
+	strcpy ( ev->name, name );
+	fprintf ( stdout, "Opened %s '%s' as %s%s%sevent device [fd %d]\n",
+			buf, name, class & EVCLASS_KEYBD ? "keyboard " : "",
+			( class & EVCLASS_KEYBD ) && ( class & EVCLASS_MOUSE ) ?
+				"and " : "",
+			class & EVCLASS_MOUSE ? "mouse " : "", fd );
+	if ( ( class & EVCLASS_LED ) && connectionok )
+	{	// Plugged in during a connection: show the host's state
+		writeleds ( fd, hostleds );
+	}
+	return	fd;
+}
+
+/*
+ *	evdevclass (fd, name, len, id) - find out what event device fd can
+ *	report (EVIOCGBIT): all letter keys make it a keyboard (power and
+ *	sleep buttons, hotkey and media devices only have a few keys of
+ *	the key table), relative X/Y motion a mouse, a keyboard with EV_LED
+ *	also gets EVCLASS_LED. Also fetch its name and id
+ *	into name (len bytes) and id.
+ *	Returns EVCLASS_* bits, 0 for anything else
+ */
+int	evdevclass ( int fd, char *name, int len, struct input_id *id )
+{
+	unsigned long	evbits[NLONGS(EV_MAX)];
+	unsigned long	keybits[NLONGS(KEY_MAX)];
+	unsigned long	relbits[NLONGS(REL_MAX)];
+	// The letter keys, in the rows of a US keyboard
+	static const int	letters[][2] = {
+		{ KEY_Q, KEY_P }, { KEY_A, KEY_L }, { KEY_Z, KEY_M } };
+	int	i, j, class = 0;
+	memset ( evbits, 0, sizeof(evbits) );
+	memset ( keybits, 0, sizeof(keybits) );
+	memset ( relbits, 0, sizeof(relbits) );
+	if ( 0 > ioctl ( fd, EVIOCGNAME(len-1), name ) ) name[0] = 0;
+	name[len-1] = 0;
+	if ( 0 > ioctl ( fd, EVIOCGID, id ) ) memset ( id, 0, sizeof(*id) );
+	if ( 0 > ioctl ( fd, EVIOCGBIT(0, sizeof(evbits)), evbits ) )
+		return	0;
+	if ( TESTBIT ( evbits, EV_KEY ) &&
+	     ( 0 <= ioctl ( fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits ) ) )
 	{
-		sprintf ( buf, EVDEVNAME, i );
-		fd = open ( buf, O_RDONLY );
-		if ( fd < 0 )
+		class |= EVCLASS_KEYBD;
+		for ( i = 0; i < sizeof(letters) / sizeof(letters[0]); ++i )
 		{
-			if ( errno == ENOENT ) { i = MAXEVDEVS ; break; }
-			if ( errno == EACCES )
+			for ( j = letters[i][0]; j <= letters[i][1]; ++j )
 			{
-				printf ( "%2d:\t[permission denied]\n", i );
+				if ( ! TESTBIT ( keybits, j ) ) class = 0;
 			}
-			continue;
-		}
-		if ( ioctl ( fd, EVIOCGID, &device_info ) < 0 )
-		{
-			close(fd); continue;
-		}
-		if ( ioctl ( fd, EVIOCGNAME(sizeof(namebuf)-4), namebuf+2) < 0 )
-		{
-			close(fd); continue;
-		}
-		namebuf[sizeof(namebuf)-4] = 0;
-		x11 = 0;
-		p = xinlist;
-		while ( ( p != NULL ) && ( *p != 0 ) )
-		{
-			if ( NULL == ( q = strchr ( p, 0x0a ) ) ) { break; }
-			*q = 0;
-			if ( strcmp ( p, namebuf + 2 ) == 0 ) { x11 = 1; }
-			*q = 0x0a;
-			while ( (*q > 0) && (*q <= 0x20 ) ) { ++q; }
-			p = q;
 		}
-		printf("%2d\t[%04hx:%04hx.%04hx] '%s' (%s)", i,
-			device_info.vendor, device_info.product,
-			device_info.version, namebuf + 2, x11 ? "+" : "-");
-		printf("\n");
-		close ( fd );
+		if ( ( class & EVCLASS_KEYBD ) && TESTBIT ( evbits, EV_LED ) )
+			class |= EVCLASS_LED;
 	}
-	free ( xinlist );
-	return	0;
+	if ( TESTBIT ( evbits, EV_REL ) &&
+	     ( 0 <= ioctl ( fd, EVIOCGBIT(EV_REL, sizeof(relbits)), relbits ) ) &&
+	     TESTBIT ( relbits, REL_X ) && TESTBIT ( relbits, REL_Y ) )
+	{
+		class |= EVCLASS_MOUSE;
+	}
+	return	class;
 }
 
-/*	parse_events - At least one filedescriptor can now be read
- *	So retrieve data and parse it, eventually sending out a hid report!
+/*
+ *	evdevwanted (class, name, id) - decide if a device is read from:
+ *	it must be a keyboard or mouse, match no -r rule and, if any -a
+ *	rules were given, match one of them. Returns 1 if so, else 0
+ */
+int	evdevwanted ( int class, const char *name, const struct input_id *id )
+{
+	struct devrule_t	*r;
+	int	accepted = ! haveaccept;
+	if ( class == 0 ) return 0;
+	for ( r = devrules; r < devrules + ndevrules; ++r )
+	{
+		if ( r->name ? ( NULL == strstr ( name, r->name ) ) :
+		     ( ( r->vendor != id->vendor ) ||
+		       ( ( r->product >= 0 ) && ( r->product != id->product ) ) ) )
+			continue;	// Rule does not match
+		if ( ! r->accept ) return 0;
+		accepted = 1;
+	}
+	return	accepted;
+}
+
+/*
+ *	adddevrule (accept, rule) - add an include (accept=1, -a) or
+ *	exclude (-r) rule for event devices. rule is either vvvv:pppp
+ *	(hex vendor and product id, pppp may be *) or part of the
+ *	device name as shown by -l.
+ *	Returns 1 on success, <0 on error
+ */
+int	adddevrule ( char accept, char *rule )
+{
+	struct devrule_t	*r;
+	unsigned int	vendor, product;
+	char	c;
+	if ( *rule == 0 )
+	{
+		fprintf ( stderr, "Empty device rule\n" );
+		return	-1;
+	}
+	if ( NULL == ( r = realloc ( devrules, ( ndevrules + 1 ) * sizeof(*r) ) ) )
+	{
+		fprintf ( stderr, "Memory alloc error\n" );
+		return	-2;
+	}
+	devrules = r;
+	r += ndevrules++;
+	r->accept = accept;
+	r->vendor = r->product = -1;
+	r->name = NULL;
+	if ( ( 2 == sscanf ( rule, "%4x:%4x%c", &vendor, &product, &c ) ) ||
+	     ( ( 2 == sscanf ( rule, "%4x:%c%c", &vendor, &c, &c ) ) &&
+	       ( 0 == strcmp ( strchr ( rule, ':' ), ":*" ) ) ) )
+	{
+		r->vendor = vendor;
+		if ( rule[strlen(rule)-1] != '*' ) r->product = product;
+	} else {
+		r->name = rule;
+	}
+	if ( accept ) haveaccept = 1;
+	return	1;
+}
+
+/*
+ *	closeevdev (fd) - close an event device that went away
+ */
+void	closeevdev ( int fd )
+{
+	fprintf ( stdout, "Closed " EVDEVNAME " [fd %d]\n",
+			evdevs[fd].num, fd );
+	if ( evdevs[fd].grabbed )
+		ioctl ( fd, EVIOCGRAB, 0 );
+	evloop_del ( fd );
+	evdev_del ( fd );
+	close ( fd );
+	return;
+}
+
+/*
+ *	watchevents () - watch EVDEVDIR, so devices that are plugged in
+ *	later can be opened (see hotplug)
+ *	Returns the inotify descriptor, or <0 on failure
+ */
+int	watchevents ( void )
+{
+	int	fd;
+	if ( ( 0 > ( fd = inotify_init1 ( IN_NONBLOCK | IN_CLOEXEC ) ) ) ||
+	     ( 0 > inotify_add_watch ( fd, EVDEVDIR,
+				IN_CREATE | IN_ATTRIB | IN_DELETE ) ) )
+	{
+		fprintf ( stderr, "Failed to watch " EVDEVDIR " for new "
+				"devices: %s\n", strerror ( errno ) );
+		if ( fd >= 0 ) close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+/*
+ *	hotplug (fd) - EVDEVDIR changed: open event devices that appeared and
+ *	close those that went away, registering them with the event loop one
+ *	by one. A new node is often only readable after udev fixed its
+ *	permissions, so opening is retried when its attributes change.
+ */
+void	hotplug ( int fd )
+{
+	char	buf[4096] __attribute((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event	*ev;
+	int	i, j, num;
+	while ( 0 < ( j = read ( fd, buf, sizeof(buf) ) ) )
+	{
+		for ( ev = (void *)buf; (char *)ev < buf + j;
+			ev = (void *)( (char *)ev + sizeof(*ev) + ev->len ) )
+		{
+			if ( ( ev->len == 0 ) ||
+			     ( 1 != sscanf ( ev->name, "event%d", &num ) ) )
+				continue;
+			if ( ( evdevonly >= 0 ) && ( evdevonly != num ) )
+				continue;
+			// Rare, so a scan of the registry is good enough
+			for ( i = 0; i < evdevslen; ++i )
+			{
+				if ( evdevs[i].used && ( evdevs[i].num == num ) )
+					break;
+			}
+			if ( ev->mask & IN_DELETE )
+			{
+				if ( i < evdevslen ) closeevdev ( i );
+				continue;
+			}
+			if ( i < evdevslen )
+				continue;	// Already open
+			if ( 0 > ( i = openevdev ( num ) ) )
+				continue;
+			if ( 0 > evloop_add ( i, EVL_EVDEV ) )
+			{
+				evdev_del ( i );
+				close ( i );
+				continue;
+			}
+			if ( stop_writing && on )
+			{	// Input currently goes to the remote side
+				evdevs[i].grabbed =
+					( 0 == ioctl ( i, EVIOCGRAB, 1 ) );
+			}
+		}
+	}
+	return;
+}
+
+/*
+ *	grabevents (grab) - with grab=1, take exclusive hold of all open event
+ *	devices (EVIOCGRAB), so their input no longer reaches the local
+ *	machine (console, X11, Wayland); grab=0 hands them back.
+ *	Done in-process, no X server required. Each device's grab status is
+ *	kept (grabbed), so only devices not yet in the wanted state are
+ *	touched. Returns the number of devices that failed to (un)grab
+ */
+int	grabevents ( int grab )
+{
+	int	i, j;
+	for ( i = j = 0; i < evdevslen; ++i )
+	{
+		if ( ! evdevs[i].used || ( evdevs[i].num < 0 ) ||
+		     ( evdevs[i].grabbed == grab ) )
+			continue;
+		if ( 0 > ioctl ( i, EVIOCGRAB, grab ) )
+		{
+			++j;
+			continue;
+		}
+		evdevs[i].grabbed = grab;
+	}
+	if ( j > 0 )
+	{
+		fprintf ( stderr, "Failed to %sgrab %d input device(s).\n",
+				grab ? "" : "un", j );
+	}
+	return	j;
+}
+
+/*
+ *	closeevents () - close all event devices, or the fifo
+ */
+void	closeevents ( void )
+{
+	int	i;
+	for ( i = 0; i < evdevslen; ++i )
+	{
+		if ( evdevs[i].used )
+		{
+			if ( evdevs[i].grabbed )
+				ioctl ( i, EVIOCGRAB, 0 );
+			close ( i );
+		}
+	}
+	free ( evdevs );
+	evdevs = NULL;
+	evdevslen = nevdevs = 0;
+	return;
+}
+
+void	cleanup_stdin ( void )
+{
+	// Cleans everything but the characters after the last ENTER keypress.
+	// This is necessary BECAUSE while reading all keyboard input from the
+	// event devices, those key presses will still stay in the stdin queue.
+	// We do not want to have a backlog of hundreds of characters, possibly
+	// commands and so on.
+	fd_set fds;
+	struct timeval tv;
+	FD_ZERO ( &fds );
+	FD_SET ( 0, &fds );
+	tv.tv_sec  = 0;
+	tv.tv_usec = 0;
+	char buf[8];
+	while ( 0 < select ( 1, &fds, NULL, NULL, &tv ) )
+	{
+		if ( 0 >= read ( 0, buf, 8 ) ) break;	// EOF, e.g. /dev/null
+		while ( 0 < read ( 0, buf, 8 ) ) {;}
+		FD_ZERO ( &fds );
+		FD_SET ( 0, &fds );
+		tv.tv_sec  = 0;
+		tv.tv_usec = 1;
+	}
+	close ( 0 );
+	return;
+}
+
+/*
+ *	evloop_add - register a file descriptor of the given kind (EVL_*)
+ *	with the main event loop, to be reported when readable.
+ *	Returns 0 on success, <0 on failure
+ */
+int	evloop_add ( int fd, int kind )
+{
+	struct epoll_event	ev;
+	memset ( &ev, 0, sizeof(ev) );
+	ev.events = EPOLLIN;
+	ev.data.u64 = EVL_DATA ( kind, fd );
+	if ( 0 > epoll_ctl ( evloopfd, EPOLL_CTL_ADD, fd, &ev ) )
+	{
+		fprintf ( stderr, "Failed to watch descriptor %d: %s\n",
+				fd, strerror ( errno ) );
+		return	-1;
+	}
+	return	0;
+}
+
+/*
+ *	evloop_mod - change the events (EPOLLIN/EPOLLOUT) a registered file
+ *	descriptor of the given kind is reported for
+ */
+void	evloop_mod ( int fd, int kind, uint32_t events )
+{
+	struct epoll_event	ev;
+	memset ( &ev, 0, sizeof(ev) );
+	ev.events = events;
+	ev.data.u64 = EVL_DATA ( kind, fd );
+	epoll_ctl ( evloopfd, EPOLL_CTL_MOD, fd, &ev );
+	return;
+}
+
+void	evloop_del ( int fd )
+{
+	epoll_ctl ( evloopfd, EPOLL_CTL_DEL, fd, NULL );
+	return;
+}
+
+// scandir filter: event device nodes in EVDEVDIR
+int	evdevfilter ( const struct dirent *de )
+{
+	return	0 == strncmp ( de->d_name, "event", 5 );
+}
+
+/*
+ *	list_input_devices - Show a human-readable list of all input devices
+ *	the current user has permissions to read from.
+ *	Add info wether this can be grabbed (-x), i.e. no other program holds
+ *	it exclusively already
+ */
+int	list_input_devices ()
+{
+	int	i, k, n, fd;
+	char	buf[sizeof(EVDEVNAME)+8];
+	struct input_id device_info;
+	struct dirent	**names;
+	char	namebuf[256];
+	char	grab = 0;
+	int	class;
+	printf ( "List of available input devices:\n");
+	printf ( "num\tVendor/Product, Name, -x compatible (+/-), "
+			"type, used (+/-)\n" );
+	if ( 0 > ( n = scandir ( EVDEVDIR, &names, evdevfilter, versionsort ) ) )
+	{
+		fprintf ( stderr, "Failed to read " EVDEVDIR ": %s\n",
+				strerror ( errno ) );
+		return	1;
+	}
+	for ( k = 0; k < n; ++k )
+	{
+		i = atoi ( names[k]->d_name + 5 );
+		free ( names[k] );
+		sprintf ( buf, EVDEVNAME, i );
+		fd = open ( buf, O_RDONLY );
+		if ( fd < 0 )
+		{
+			if ( errno == EACCES )
+			{
+				printf ( "%2d:\t[permission denied]\n", i );
+			}
+			continue;
+		}
+		class = evdevclass ( fd, namebuf, sizeof(namebuf), &device_info );
+		grab = 0;
+		if ( 0 == ioctl ( fd, EVIOCGRAB, 1 ) )
+		{
+			ioctl ( fd, EVIOCGRAB, 0 );
+			grab = 1;
+		}
+		printf("%2d\t[%04hx:%04hx.%04hx] '%s' (%s) %s%s%s (%s)", i,
+			device_info.vendor, device_info.product,
+			device_info.version, namebuf, grab ? "+" : "-",
+			class & EVCLASS_KEYBD ? "k" : "",
+			class & EVCLASS_MOUSE ? "m" : "",
+			class ? "" : "other",
+			evdevwanted ( class, namebuf, &device_info ) ? "+" : "-");
+		printf("\n");
+		close ( fd );
+	}
+	free ( names );
+	return	0;
+}
+
+/*	keyarray - Fill the key array key[len] of a keyboard report with the
+ *	keys set in bits. With more keys pressed than fit, every slot holds
+ *	ErrorRollOver (0x01), as HID wants, rather than some of the keys
+ */
+void	keyarray ( unsigned char * key, int len, const unsigned char * bits )
+{
+	int	i, k, n;
+	memset ( key, 0, len );
+	for ( i = n = 0; i < sizeof(pressedbits); ++i )
+	{
+		if ( bits[i] == 0 ) continue;
+		for ( k = 0; k < 8; ++k )
+		{
+			if ( ! ( bits[i] & ( 1 << k ) ) ) continue;
+			if ( n == len )
+			{	// Too many
+				memset ( key, 0x01, len );
+				return;
+			}
+			key[n++] = i * 8 + k;
+		}
+	}
+	return;
+}
+
+/*	keyreport - Build the keyboard report for the modifier byte mod and
+ *	the keys set in the bitset bits (bit per usage, like pressedbits),
+ *	as 8-key array or, in N-key-rollover mode, as bitmap. In boot
+ *	protocol, it is the boot keyboard report with up to 6 keys.
+ *	Return value is the length of the report in bytes
+ */
+int	keyreport ( void * hidrep, unsigned char mod, const unsigned char * bits )
+{
+	struct hidrep_keyb_t	* evkeyb = hidrep;
+	struct hidrep_nkro_t	* evnkro = hidrep;
+	struct hidrep_bootkeyb_t	* evboot = hidrep;
+	if ( __atomic_load_n ( &protocolmode, __ATOMIC_RELAXED ) ==
+			HIDP_PROTO_BOOT )
+	{
+		evboot->btcode = 0xA1;
+		evboot->rep_id = BOOTID_KEYBD;
+		evboot->modify = mod;
+		evboot->reserved = 0;
+		keyarray ( evboot->key, sizeof(evboot->key), bits );
+		return	sizeof(*evboot);
+	}
+	if ( nkro )
+	{
+		evnkro->btcode = 0xA1;
+		evnkro->rep_id = REPORTID_KEYBD;
+		evnkro->modify = mod;
+		memcpy ( evnkro->bits, bits, sizeof(evnkro->bits) );
+		return	sizeof(struct hidrep_nkro_t);
+	}
+	evkeyb->btcode = 0xA1;
+	evkeyb->rep_id = REPORTID_KEYBD;
+	evkeyb->modify = mod;
+	keyarray ( evkeyb->key, sizeof(evkeyb->key), bits );
+	return	sizeof(struct hidrep_keyb_t);
+}
+
+// Report id of keyboard reports in the current protocol
+unsigned char	keybreportid ( void )
+{
+	return	( __atomic_load_n ( &protocolmode, __ATOMIC_RELAXED ) ==
+			HIDP_PROTO_BOOT ) ? BOOTID_KEYBD : REPORTID_KEYBD;
+}
+
+/*	sendreport - Send a hid report on the (non-blocking) interrupt channel
+ *	If the channel is congested, the report is queued and sent as soon
+ *	as the event loop sees the channel writable, so input processing
+ *	never waits for the radio. Reports keep their order.
+ *	On a full queue (the link is stalled): a mouse report is dropped;
+ *	a keyboard report is kept aside, replacing an older one kept aside
+ *	before, and queued first when there is room again. As keyboard
+ *	reports carry the complete key state, the host then still ends up
+ *	with the current state, so no key can get stuck.
+ *	A keyboard report equal to the previous one is not sent at all:
+ *	pressing or releasing a Neo layer key alone, for example, does not
+ *	change the bytes on the wire.
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	sendreport ( int sockdesc, const void * rep, int len )
+{
+	struct hidrep_slot_t	* slot;
+	if ( ((const unsigned char *)rep)[1] == keybreportid () )
+	{
+		if ( ( len == replastkeyb.len ) &&
+		     ( 0 == memcmp ( replastkeyb.data, rep, len ) ) )
+			return	0;
+		setlastkeyb ( rep, len );
+	}
+	if ( pipelined )
+	{	// Translator thread: the transmitter sends it
+		return	pipereport ( rep, len );
+	}
+	if ( NULL != repout )
+	{	// Replay (-P): no connection, the reports go to a file
+		writereport ( rep, len );
+		latrecord ( evstamp );
+		__atomic_fetch_add ( &statsent, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_add ( &statbytes, len, __ATOMIC_RELAXED );
+		return	0;
+	}
+	if ( repqcount == 0 )
+	{
+		if ( 0 < send ( sockdesc, rep, len, MSG_NOSIGNAL ) )
+		{
+			latrecord ( evstamp );
+			__atomic_fetch_add ( &statsent, 1, __ATOMIC_RELAXED );
+			__atomic_fetch_add ( &statbytes, len, __ATOMIC_RELAXED );
+			return	0;
+		}
+		if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) )
+		{
+			__atomic_fetch_add ( &statsenderr, 1,
+					__ATOMIC_RELAXED );
+			return	-1;
+		}
+		__atomic_fetch_add ( &stateagain, 1, __ATOMIC_RELAXED );
+		// Congested: wait for the channel to become writable
+		evloop_mod ( sockdesc, EVL_INT, EPOLLIN | EPOLLOUT );
+	}
+	if ( repqcount < REPQUEUELEN )
+	{
+		slot = &repqueue[(repqhead + repqcount) % REPQUEUELEN];
+		++repqcount;
+	}
+	else
+	{
+		__atomic_fetch_add ( &repdropped, 1, __ATOMIC_RELAXED );
+		if ( debugevents & 0x2 )
+			fprintf ( stderr, "Report queue full, %u dropped\n",
+				__atomic_load_n ( &repdropped, __ATOMIC_RELAXED ) );
+		if ( ((const unsigned char *)rep)[1] != keybreportid () )
+			return	0;
+		slot = &repkeyblatest;
+	}
+	memcpy ( slot->data, rep, len );
+	slot->len = len;
+	slot->stamp = evstamp;
+	return	0;
+}
+
+/*	flushreports - The interrupt channel is writable again: send queued
+ *	reports until it is congested again or the queue is empty.
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	flushreports ( int sockdesc )
+{
+	struct hidrep_slot_t	* slot;
+	while ( repqcount > 0 )
+	{
+		slot = &repqueue[repqhead];
+		if ( 0 >= send ( sockdesc, slot->data, slot->len, MSG_NOSIGNAL ) )
+		{
+			if ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) )
+			{
+				__atomic_fetch_add ( &stateagain, 1,
+						__ATOMIC_RELAXED );
+				return	0;
+			}
+			__atomic_fetch_add ( &statsenderr, 1,
+					__ATOMIC_RELAXED );
+			return	-1;
+		}
+		latrecord ( slot->stamp );
+		__atomic_fetch_add ( &statsent, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_add ( &statbytes, slot->len,
+				__ATOMIC_RELAXED );
+		repqhead = ( repqhead + 1 ) % REPQUEUELEN;
+		--repqcount;
+		if ( repkeyblatest.len > 0 )
+		{	// A slot is free again for the newest keyboard state
+			repqueue[(repqhead + repqcount) % REPQUEUELEN] =
+				repkeyblatest;
+			++repqcount;
+			repkeyblatest.len = 0;
+		}
+	}
+	evloop_mod ( sockdesc, EVL_INT, EPOLLIN );
+	return	0;
+}
+
+// Forget all pending reports, when a connection is opened or closed
+void	clearreports ( void )
+{
+	repqhead = repqcount = 0;
+	repkeyblatest.len = 0;
+	setlastkeyb ( NULL, 0 );
+	return;
+}
+
+/*	setlastkeyb - Remember rep as the last keyboard report (none if len
+ *	is 0). Only sendreport's thread writes replastkeyb, but with -p
+ *	the main loop reads it for GET_REPORT, so it is guarded by a
+ *	sequence counter: odd while the report changes, see currentreport
+ */
+void	setlastkeyb ( const void * rep, int len )
+{
+	unsigned int	seq = replastseq;
+	__atomic_store_n ( &replastseq, seq + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_RELEASE );
+	if ( len > 0 ) memcpy ( replastkeyb.data, rep, len );
+	replastkeyb.len = len;
+	__atomic_store_n ( &replastseq, seq + 2, __ATOMIC_RELEASE );
+	return;
+}
+
+/*	idlereport - Report id in protocol (HIDP_PROTO_*) with no keys or
+ *	buttons pressed and no motion, written to rep as sent on the
+ *	interrupt channel. Return value is its length, <0 for an unknown id
+ */
+int	idlereport ( char protocol, unsigned char id, unsigned char * rep )
+{
+	int	len;
+	if ( protocol == HIDP_PROTO_BOOT )
+	{
+		if ( id == BOOTID_KEYBD )
+			len = sizeof(struct hidrep_bootkeyb_t);
+		else if ( id == BOOTID_MOUSE )
+			len = sizeof(struct hidrep_bootmouse_t);
+		else	return	-1;
+	}
+	else
+	{
+		if ( id == REPORTID_KEYBD )
+			len = nkro ? sizeof(struct hidrep_nkro_t) :
+				sizeof(struct hidrep_keyb_t);
+		else if ( id == REPORTID_MOUSE )
+			len = sizeof(struct hidrep_mouse_t);
+		else	return	-1;
+	}
+	memset ( rep, 0, len );
+	rep[0] = 0xA1;
+	rep[1] = id;
+	return	len;
+}
+
+/*	currentreport - The input report id as the focused host would get
+ *	it now, for GET_REPORT: the keyboard report sent last (no keys if
+ *	none, or if it was sent in the other protocol), the mouse buttons
+ *	without motion. Written to rep as sent on the interrupt channel.
+ *	Return value is its length, <0 for an unknown id
+ */
+int	currentreport ( unsigned char id, unsigned char * rep )
+{
+	unsigned char	last[REPMAXLEN];
+	unsigned int	seq;
+	int		len, lastlen;
+	if ( 0 > ( len = idlereport ( protocolmode, id, rep ) ) )
+		return	-1;
+	if ( id != keybreportid () )
+	{	// Mouse: the buttons are the first byte in both protocols
+		rep[2] = __atomic_load_n ( &mousebuttons, __ATOMIC_RELAXED ) &
+				0x07;
+		return	len;
+	}
+	do
+	{	// Retry if the translator (-p) changed it meanwhile
+		while ( 1 & ( seq = __atomic_load_n ( &replastseq,
+				__ATOMIC_ACQUIRE ) ) )
+			sched_yield ();
+		lastlen = replastkeyb.len;
+		if ( lastlen > 0 ) memcpy ( last, replastkeyb.data, lastlen );
+		__atomic_thread_fence ( __ATOMIC_ACQUIRE );
+	}
+	while ( seq != __atomic_load_n ( &replastseq, __ATOMIC_RELAXED ) );
+	if ( ( lastlen == len ) && ( last[1] == id ) )
+		memcpy ( rep, last, len );
+	return	len;
+}
+
+// Answer on the control channel, never waiting for it: the host asks again
+int	ctlreply ( int sctl, const void * msg, int len )
+{
+	if ( 0 < send ( sctl, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT ) )
+		return	0;
+	if ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) )
+		return	0;
+	return	-1;
+}
+
+/*	handlecontrol - Read one request of host s from the control
+ *	channel and answer it right away, from the current state:
+ *	GET_REPORT from currentreport (a host without the focus has
+ *	nothing pressed), SET/GET_PROTOCOL (switching between report and
+ *	boot protocol, see keyreport and flush_mouse) and SET/GET_IDLE
+ *	(only remembered, reports are not repeated) from the session.
+ *	The keyboard LED output report can be set (see outputreport) and
+ *	read back; there are no feature reports.
+ *	Everything else gets a HANDSHAKE with ERR_UNSUPPORTED_REQUEST,
+ *	so the host does not wait for an answer that never comes.
+ *	Return value <0 means the channel was closed, or the host sent
+ *	VIRTUAL_CABLE_UNPLUG; the connection shall be closed
+ */
+int	handlecontrol ( struct session_t * s )
+{
+	unsigned char	msg[64], ans[REPMAXLEN];
+	int		j, len, size;
+	char		focused = ( focus >= 0 ) && ( s == &sessions[focus] );
+	unsigned char	keybid = ( s->protocol == HIDP_PROTO_BOOT ) ?
+				BOOTID_KEYBD : REPORTID_KEYBD;
+	j = recv ( s->sctl, msg, sizeof(msg), MSG_DONTWAIT );
+	if ( j < 0 )
+	{
+		if ( ( errno == EAGAIN ) || ( errno == EINTR ) )
+			return	0;
+		s->linklost = LINKLOST ( errno );
+		return	-1;
+	}
+	if ( j == 0 )
+		return	-1;
+	if ( debugevents & 0x2 )
+		fprintf ( stderr, "Control request %02x (%d bytes)\n",
+				msg[0], j );
+	ans[0] = HIDP_HANDSHAKE | HIDP_HSHK_SUCCESSFUL;
+	len = 1;
+	switch ( msg[0] & 0xf0 )
+	{
+	  case	HIDP_CONTROL:
+		if ( ( msg[0] & 0x0f ) == HIDP_CTRL_VIRTUAL_CABLE_UNPLUG )
+		{
+			fprintf ( stderr, "Host unplugged the virtual cable\n" );
+			unbondhost ( s->peer );	// Not to be dialed back
+			return	-1;
+		}
+		return	0;	// Suspend and the like need no answer
+	  case	HIDP_GET_REPORT:
+		if ( ( ( msg[0] & HIDP_REPTYPE_MASK ) == HIDP_REPTYPE_OUTPUT ) &&
+		     ( j >= 2 ) && ( msg[1] == keybid ) )
+		{
+			ans[0] = HIDP_DATA | HIDP_REPTYPE_OUTPUT;
+			ans[1] = msg[1];
+			ans[2] = s->leds;
+			len = 3;
+			break;
+		}
+		if ( ( msg[0] & HIDP_REPTYPE_MASK ) != HIDP_REPTYPE_INPUT )
+		{
+			ans[0] = HIDP_HANDSHAKE | HIDP_HSHK_ERR_INVALID_REPORT_ID;
+			break;
+		}
+		if ( ( j < 2 ) || ( 0 > ( len = focused ?
+			currentreport ( msg[1], ans ) :
+			idlereport ( s->protocol, msg[1], ans ) ) ) )
+		{
+			ans[0] = HIDP_HANDSHAKE | HIDP_HSHK_ERR_INVALID_REPORT_ID;
+			len = 1;
+			break;
+		}
+		ans[0] = HIDP_DATA | HIDP_REPTYPE_INPUT;
+		if ( ( msg[0] & HIDP_GETREP_SIZE ) && ( j >= 4 ) )
+		{	// Report id and data limited to size bytes
+			size = msg[2] | ( msg[3] << 8 );
+			if ( len > size + 1 ) len = size + 1;
+		}
+		break;
+	  case	HIDP_SET_REPORT:
+		if ( ( ( msg[0] & HIDP_REPTYPE_MASK ) != HIDP_REPTYPE_OUTPUT ) ||
+		     ( 0 > outputreport ( s, msg + 1, j - 1 ) ) )
+			ans[0] = HIDP_HANDSHAKE | HIDP_HSHK_ERR_INVALID_REPORT_ID;
+		break;
+	  case	HIDP_GET_PROTOCOL:
+		ans[0] = HIDP_DATA;
+		ans[1] = s->protocol;
+		len = 2;
+		break;
+	  case	HIDP_SET_PROTOCOL:
+		if ( ( msg[0] & 0x01 ) == s->protocol )
+			break;
+		s->protocol = msg[0] & 0x01;
+		fprintf ( stdout, "%s switched to %s protocol\n", s->peer,
+			s->protocol == HIDP_PROTO_BOOT ? "boot" : "report" );
+		if ( focused )
+		{	// Reports built from now on use the new format
+			__atomic_store_n ( &protocolmode, s->protocol,
+					__ATOMIC_RELAXED );
+		}
+		break;
+	  case	HIDP_GET_IDLE:
+		ans[0] = HIDP_DATA;
+		ans[1] = s->idlerate;
+		len = 2;
+		break;
+	  case	HIDP_SET_IDLE:
+		if ( j >= 2 ) s->idlerate = msg[1];
+		break;
+	  default:
+		ans[0] = HIDP_HANDSHAKE | HIDP_HSHK_ERR_UNSUPPORTED;
+	}
+	return	ctlreply ( s->sctl, ans, len );
+}
+
+/*	outputreport - An output report from host s, as SET_REPORT on the
+ *	control or DATA on the interrupt channel: rep[len] is the report id
+ *	and data. The only one is the keyboard's LED state, the same in
+ *	boot protocol; the local LEDs show the one of the focused host.
+ *	Returns <0 for an unknown report id
+ */
+int	outputreport ( struct session_t * s, const unsigned char * rep, int len )
+{
+	if ( ( len < 2 ) || ( rep[0] != ( s->protocol == HIDP_PROTO_BOOT ?
+					BOOTID_KEYBD : REPORTID_KEYBD ) ) )
+		return	-1;
+	s->leds = rep[1] & 0x1f;
+	if ( ( focus >= 0 ) && ( s == &sessions[focus] ) )
+		setleds ( s->leds );
+	return	0;
+}
+
+/*	setleds - Show the LED state leds of the host (bit 0 Num Lock, then
+ *	Caps Lock, Scroll Lock, Compose, Kana, the order of the LED_*
+ *	event codes as well) on all local keyboards with LEDs
+ */
+void	setleds ( unsigned char leds )
+{
+	int	fd;
+	if ( leds == hostleds )
+		return;
+	hostleds = leds;
+	if ( debugevents & 0x2 )
+		fprintf ( stderr, "Host LEDs %02x\n", leds );
+	for ( fd = 0; fd < evdevslen; ++fd )
+	{
+		if ( evdevs[fd].used && ( evdevs[fd].class & EVCLASS_LED ) )
+			writeleds ( fd, leds );
+	}
+	return;
+}
+
+// Write the LED state leds to event device fd (ignored if read-only)
+void	writeleds ( int fd, unsigned char leds )
+{
+	struct input_event	ev[LED_KANA+2];
+	int	i;
+	memset ( ev, 0, sizeof(ev) );
+	for ( i = LED_NUML; i <= LED_KANA; ++i )
+	{
+		ev[i].type = EV_LED;
+		ev[i].code = i;
+		ev[i].value = ( leds >> i ) & 1;
+	}
+	ev[i].type = EV_SYN;
+	ev[i].code = SYN_REPORT;
+	if ( write ( fd, ev, sizeof(ev) ) ) {;}
+	return;
+}
+
+/*
+ *	sessionopen (sctl, peer) - a host opened the control channel sctl:
+ *	start a session for it, waiting for the interrupt channel (see
+ *	sessionpair). Returns its number, <0 if MAXHOSTS are connected
+ */
+int	sessionopen ( int sctl, const char * peer )
+{
+	struct session_t	*s;
+	int	n;
+	for ( n = 0; ( n < MAXHOSTS ) && ( sessions[n].sctl >= 0 ); ++n );
+	if ( n == MAXHOSTS )
+	{
+		fprintf ( stderr, "%d hosts connected already, refusing %s\n",
+				MAXHOSTS, peer );
+		return	-1;
+	}
+	s = &sessions[n];
+	memset ( s, 0, sizeof(*s) );
+	s->sctl = sctl;
+	s->sint = -1;
+	snprintf ( s->peer, sizeof(s->peer), "%s", peer );
+	s->since = nowstamp ();
+	// Every connection starts in report protocol
+	s->protocol = HIDP_PROTO_REPORT;
+	evloop_add ( sctl, EVL_CTL );
+	return	n;
+}
+
+/*
+ *	sessionpair (peer) - find the session an interrupt channel from
+ *	peer belongs to: the one waiting for it from the same host, else
+ *	(peers that cannot be told apart) the one waiting longest.
+ *	Returns its number, <0 if none waits
+ */
+int	sessionpair ( const char * peer )
+{
+	int	n, found = -1;
+	for ( n = 0; n < MAXHOSTS; ++n )
+	{
+		if ( ( sessions[n].sctl < 0 ) || ( sessions[n].sint >= 0 ) ||
+		     sessions[n].dialed )
+			continue;
+		if ( 0 == strcmp ( sessions[n].peer, peer ) )
+			return	n;
+		if ( ( found < 0 ) || ( sessions[n].since < sessions[found].since ) )
+			found = n;
+	}
+	return	found;
+}
+
+// Number of the session using channel fd, or <0
+int	sessionfind ( int fd )
+{
+	int	n;
+	for ( n = 0; n < MAXHOSTS; ++n )
+	{
+		if ( ( sessions[n].sctl >= 0 ) &&
+		     ( ( sessions[n].sctl == fd ) || ( sessions[n].sint == fd ) ) )
+			return	n;
+	}
+	return	-1;
+}
+
+// The established session after n (in turn), other than n; <0 if none
+int	sessionnext ( int n )
+{
+	int	i, k;
+	for ( i = 1; i <= MAXHOSTS; ++i )
+	{
+		k = ( n + i + MAXHOSTS ) % MAXHOSTS;
+		if ( ( k != n ) && ( sessions[k].sint >= 0 ) )
+			return	k;
+	}
+	return	-1;
+}
+
+/*
+ *	sessionclose (n) - close the connection to host n. If it had the
+ *	focus, the next connected host gets it
+ */
+void	sessionclose ( int n )
+{
+	struct session_t	*s = &sessions[n];
+	if ( n == focus )
+	{
+		focus = -1;
+		connectionok = 0;
+		if ( pipelined )
+			pipesession ( -1, 0, NULL, 0 );
+		else
+			clearreports ();
+		setleds ( 0 );	// No host to show them for
+	}
+	if ( s->sint >= 0 )
+	{
+		evloop_del ( s->sint );
+		close ( s->sint );
+		fprintf ( stderr, "Connection to %s closed\n", s->peer );
+		if ( s->linklost && ( dialpeer[0] == 0 ) &&
+		     ( 0 <= isbonded ( s->peer ) ) && ! prepareshutdown )
+		{	// Link lost: dial the host back, right away. A host
+			// disconnecting on purpose is left alone
+			snprintf ( dialpeer, sizeof(dialpeer), "%s", s->peer );
+			dialbackoff = DIALMIN;
+			dialat = nowstamp ();
+		}
+	}
+	evloop_del ( s->sctl );
+	close ( s->sctl );
+	s->sctl = s->sint = -1;
+	s->nrelease = 0;
+	s->dialed = s->linklost = 0;
+	if ( n == dialsession )
+	{	// Its interrupt channel is still being connected
+		dialsession = -1;
+		dialfailed ( "control channel closed" );
+	}
+	if ( ( focus < 0 ) && ( 0 <= ( n = sessionnext ( n ) ) ) )
+		switchfocus ( n, 1 );
+	return;
+}
+
+/*
+ *	halfopen () - close the sessions whose interrupt channel did not
+ *	come within INTCHANTIMEOUT. Returns the milliseconds until the
+ *	next of the others times out, -1 if none waits
+ */
+int	halfopen ( void )
+{
+	uint64_t	now = nowstamp ();
+	int	n, ms, wait = -1;
+	for ( n = 0; n < MAXHOSTS; ++n )
+	{
+		if ( ( sessions[n].sctl < 0 ) || ( sessions[n].sint >= 0 ) )
+			continue;
+		ms = INTCHANTIMEOUT - (int)( ( now - sessions[n].since ) / 1000000 );
+		if ( ms <= 0 )
+		{
+			fprintf ( stderr, "Interrupt connection failed to "
+					"establish (control connection already"
+					" there), timeout!\n" );
+			sessionclose ( n );
+			continue;
+		}
+		if ( ( wait < 0 ) || ( ms < wait ) ) wait = ms;
+	}
+	return	wait;
+}
+
+/*
+ *	switchfocus (n, fresh) - send the input to host n from now on.
+ *	The host that had it gets reports with all keys and buttons
+ *	released, so nothing stays pressed there, and keeps its connection.
+ *	With fresh, the key and mouse state starts from scratch, as for a
+ *	new connection; otherwise keys still held are sent to host n with
+ *	the next report
+ */
+void	switchfocus ( int n, char fresh )
+{
+	struct session_t	*old = ( focus >= 0 ) ? &sessions[focus] : NULL;
+	struct session_t	*s = &sessions[n];
+	int	i;
+	if ( NULL != old )
+	{
+		old->nrelease = 0;
+		i = idlereport ( old->protocol, old->protocol == HIDP_PROTO_BOOT ?
+				BOOTID_KEYBD : REPORTID_KEYBD,
+				old->release[old->nrelease].data );
+		old->release[old->nrelease++].len = i;
+		i = idlereport ( old->protocol, old->protocol == HIDP_PROTO_BOOT ?
+				BOOTID_MOUSE : REPORTID_MOUSE,
+				old->release[old->nrelease].data );
+		old->release[old->nrelease++].len = i;
+		if ( ! pipelined )
+		{	// What is queued for old is outdated by these
+			clearreports ();
+			sendrelease ( focus );
+		}
+	}
+	focus = n;
+	__atomic_store_n ( &protocolmode, s->protocol, __ATOMIC_RELAXED );
+	if ( pipelined )
+	{	// The key state belongs to the translator. The transmitter
+		// sends the release reports, after what it has for old
+		pipesession ( s->sint, fresh, old ? old->release : NULL,
+				old ? old->nrelease : 0 );
+		if ( old ) old->nrelease = 0;
+	}
+	else
+	{
+		clearreports ();
+		// The new host never saw the modifiers held now pressed
+		maskedmods = modifierkeys & REALMODS;
+		if ( fresh )
+		{
+			memset ( pressedbits, 0, sizeof(pressedbits) );
+			modifierkeys = 0;
+			mousebuttons = 0;
+			mousedx = mousedy = mousedz = 0;
+			maskedmods = 0;
+		}
+		for ( i = 0; i < s->nrelease; ++i )
+		{	// Still owed from losing the focus before
+			sendreport ( s->sint, s->release[i].data,
+					s->release[i].len );
+		}
+		s->nrelease = 0;
+		evloop_mod ( s->sint, EVL_INT, EPOLLIN );
+	}
+	setleds ( s->leds );
+	connectionok = 1;
+	fprintf ( stdout, "Input goes to %s\n", s->peer );
+	return;
+}
+
+/*
+ *	sendrelease (n) - send the all-released reports host n is owed
+ *	(see switchfocus) as far as its interrupt channel takes them; the
+ *	rest follows when it is writable again.
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	sendrelease ( int n )
+{
+	struct session_t	*s = &sessions[n];
+	while ( s->nrelease > 0 )
+	{
+		if ( 0 >= send ( s->sint, s->release[0].data, s->release[0].len,
+				MSG_NOSIGNAL ) )
+		{
+			if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) )
+				return	-1;
+			evloop_mod ( s->sint, EVL_INT, EPOLLIN | EPOLLOUT );
+			return	0;
+		}
+		if ( --s->nrelease > 0 )
+			s->release[0] = s->release[1];
+	}
+	evloop_mod ( s->sint, EVL_INT, EPOLLIN );
+	return	0;
+}
+
+// LAlt+PRINT: let the main loop move the input to the next host
+void	requestfocus ( void )
+{
+	__atomic_store_n ( &focusrequest, 1, __ATOMIC_RELEASE );
+	if ( pipelined )
+		pipenotify ();
+	return;
+}
+
+/*
+ *	sessionestablish (n, sint) - the interrupt channel sint of session
+ *	n is connected: the host is fully there, and gets the input if no
+ *	other host has it
+ */
+void	sessionestablish ( int n, int sint )
+{
+	struct session_t	*s = &sessions[n];
+	s->sint = sint;
+	// Never block input processing on the radio
+	fcntl ( sint, F_SETFL, fcntl ( sint, F_GETFL ) | O_NONBLOCK );
+	evloop_add ( sint, EVL_INT );
+	++statconns;
+	if ( transport->bonding || s->dialed )
+		bondhost ( s->peer );
+	if ( 0 == strcmp ( s->peer, dialpeer ) )
+	{	// Back before we reached it
+		dialcancel ();
+	}
+	if ( focus < 0 )
+	{
+		switchfocus ( n, 1 );
+		return;
+	}
+	fprintf ( stdout, "Input still goes to %s, LAlt+PRINT switches\n",
+			sessions[focus].peer );
+	return;
+}
+
+/*
+ *	loadbonded (filename) - read the known hosts, one address per line
+ *	(as the transport connects to it), the last one connected first;
+ *	lines starting with # are comments. A missing file is no error, it
+ *	is written when the first host connects. Returns <0 on error
+ */
+int	loadbonded ( char * filename )
+{
+	FILE	*f;
+	char	line[256];
+	int	len;
+	bondname = filename;
+	if ( NULL == ( f = fopen ( filename, "r" ) ) )
+	{
+		if ( errno == ENOENT ) return 0;
+		fprintf ( stderr, "Failed to open [%s]: %s\n", filename,
+				strerror ( errno ) );
+		return	-1;
+	}
+	while ( ( nbonded < MAXBONDED ) && fgets ( line, sizeof(line), f ) )
+	{
+		len = strcspn ( line, "\r\n" );
+		line[len] = 0;
+		if ( ( len == 0 ) || ( line[0] == '#' ) ) continue;
+		if ( len >= sizeof(bonded[0]) )
+		{
+			fprintf ( stderr, "%s: address [%s] too long\n",
+					filename, line );
+			continue;
+		}
+		strcpy ( bonded[nbonded++], line );
+	}
+	fclose ( f );
+	return	0;
+}
+
+// Write the known hosts back (-b), replacing the file only when complete
+void	savebonded ( void )
+{
+	FILE	*f;
+	char	tmpname[4096];
+	int	i;
+	if ( NULL == bondname ) return;
+	snprintf ( tmpname, sizeof(tmpname), "%s.tmp", bondname );
+	if ( NULL == ( f = fopen ( tmpname, "w" ) ) )
+	{
+		fprintf ( stderr, "Failed to create [%s]: %s\n", tmpname,
+				strerror ( errno ) );
+		return;
+	}
+	fprintf ( f, "# Hosts known to hidclient, the last connected first\n" );
+	for ( i = 0; i < nbonded; ++i )
+		fprintf ( f, "%s\n", bonded[i] );
+	if ( ( 0 != fclose ( f ) ) || ( 0 != rename ( tmpname, bondname ) ) )
+	{
+		fprintf ( stderr, "Failed to write [%s]\n", bondname );
+		remove ( tmpname );
+	}
+	return;
+}
+
+// Index of addr in the known hosts, <0 if it is none
+int	isbonded ( const char * addr )
+{
+	int	i;
+	for ( i = 0; i < nbonded; ++i )
+	{
+		if ( 0 == strcmp ( bonded[i], addr ) ) return i;
+	}
+	return	-1;
+}
+
+// Host addr connected: it goes first in the known hosts (-b)
+void	bondhost ( const char * addr )
+{
+	int	i;
+	if ( ( NULL == bondname ) || ( strlen ( addr ) >= sizeof(bonded[0]) ) )
+		return;
+	if ( 0 == ( i = isbonded ( addr ) ) )
+		return;	// Already first
+	if ( i < 0 )
+		i = ( nbonded < MAXBONDED ) ? nbonded++ : MAXBONDED - 1;
+	memmove ( bonded[1], bonded[0], i * sizeof(bonded[0]) );
+	strcpy ( bonded[0], addr );
+	savebonded ();
+	return;
+}
+
+// Host addr unplugged the virtual cable: forget it
+void	unbondhost ( const char * addr )
+{
+	int	i;
+	if ( 0 > ( i = isbonded ( addr ) ) )
+		return;
+	memmove ( bonded[i], bonded[i+1], ( nbonded - i - 1 ) *
+			sizeof(bonded[0]) );
+	--nbonded;
+	savebonded ();
+	if ( 0 == strcmp ( addr, dialpeer ) )
+		dialcancel ();
+	return;
+}
+
+/*
+ *	dialwait () - dial back dialpeer (see sessionclose), both channels
+ *	one after the other like a host connects them, without waiting for
+ *	them (see dialready). Starts the next attempt when it is due.
+ *	Returns the milliseconds until then, -1 if there is nothing to wait
+ *	for
+ */
+int	dialwait ( void )
+{
+	uint64_t	now;
+	if ( ( dialpeer[0] == 0 ) || ( dialfd >= 0 ) )
+		return	-1;
+	now = nowstamp ();
+	if ( now < dialat )
+		return	(int)( ( dialat - now + 999999 ) / 1000000 );
+	if ( ( 0 > ( dialfd = transport->connect ( dialpeer, PSMHIDCTL ) ) ) ||
+	     evloop_add ( dialfd, EVL_DIAL ) )
+	{
+		dialfailed ( strerror ( errno ) );
+		return	dialbackoff;
+	}
+	evloop_mod ( dialfd, EVL_DIAL, EPOLLOUT );
+	return	-1;
+}
+
+/*
+ *	dialready (fd) - the connection dialwait started on fd is done:
+ *	with the control channel there, connect the interrupt channel;
+ *	with both there, the session is established
+ */
+void	dialready ( int fd )
+{
+	int		err = 0, n;
+	socklen_t	len = sizeof(err);
+	if ( fd != dialfd )
+		return;	// Cancelled
+	if ( 0 > getsockopt ( fd, SOL_SOCKET, SO_ERROR, &err, &len ) )
+		err = errno;
+	if ( err )
+	{
+		dialfailed ( strerror ( err ) );
+		return;
+	}
+	evloop_del ( fd );
+	dialfd = -1;
+	if ( dialsession < 0 )
+	{	// Control channel connected
+		if ( 0 > ( n = sessionopen ( fd, dialpeer ) ) )
+		{
+			close ( fd );
+			dialfailed ( "no session free" );
+			return;
+		}
+		sessions[n].dialed = 1;
+		dialsession = n;
+		if ( ( 0 > ( dialfd = transport->connect ( dialpeer,
+					PSMHIDINT ) ) ) ||
+		     evloop_add ( dialfd, EVL_DIAL ) )
+		{
+			dialfailed ( strerror ( errno ) );
+			return;
+		}
+		evloop_mod ( dialfd, EVL_DIAL, EPOLLOUT );
+		return;
+	}
+	n = dialsession;
+	dialsession = -1;
+	if ( ( sessions[n].sctl < 0 ) || ( sessions[n].sint >= 0 ) )
+	{	// The control channel timed out (see halfopen) meanwhile
+		close ( fd );
+		dialfailed ( "control channel closed" );
+		return;
+	}
+	fprintf ( stdout, "Reconnected to %s\n", dialpeer );
+	sessionestablish ( n, fd );	// Ends the dialing
+	return;
+}
+
+// An attempt to dial back failed for reason: try again after the backoff
+void	dialfailed ( const char * reason )
+{
+	int	n = dialsession;
+	if ( dialfd >= 0 )
+	{
+		evloop_del ( dialfd );
+		close ( dialfd );
+		dialfd = -1;
+	}
+	dialsession = -1;
+	if ( ( n >= 0 ) && ( sessions[n].sctl >= 0 ) && ( sessions[n].sint < 0 ) )
+		sessionclose ( n );
+	fprintf ( stderr, "Reconnecting to %s failed (%s), next try in "
+			"%d s\n", dialpeer, reason, ( dialbackoff + 999 ) / 1000 );
+	dialat = nowstamp () + dialbackoff * 1000000ULL;
+	dialbackoff = ( dialbackoff * 2 < DIALMAX ) ? dialbackoff * 2 : DIALMAX;
+	return;
+}
+
+// Stop dialing back (the host is there, or gone for good)
+void	dialcancel ( void )
+{
+	int	n = dialsession;
+	dialpeer[0] = 0;
+	if ( dialfd >= 0 )
+	{
+		evloop_del ( dialfd );
+		close ( dialfd );
+		dialfd = -1;
+	}
+	dialsession = -1;
+	if ( ( n >= 0 ) && ( sessions[n].sctl >= 0 ) && ( sessions[n].sint < 0 ) )
+		sessionclose ( n );
+	return;
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+uint64_t	nowstamp ( void )
+{
+	struct timespec	ts;
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return	ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*	latbucket - Return the latency histogram bucket for ns nanoseconds:
+ *	values below 2^LATSUBBITS have a bucket each, larger ones share one
+ *	per 2^LATSUBBITS steps of each power of two (HDR histogram style)
+ */
+int	latbucket ( uint64_t ns )
+{
+	int	shift;
+	if ( ns < ( 1 << LATSUBBITS ) ) return ns;
+	shift = 63 - __builtin_clzll ( ns ) - LATSUBBITS;
+	return	( ( shift + 1 ) << LATSUBBITS ) +
+		( ( ns >> shift ) & ( ( 1 << LATSUBBITS ) - 1 ) );
+}
+
+// Highest value (ns) that falls into latency histogram bucket b
+uint64_t	latvalue ( int b )
+{
+	int	shift;
+	if ( b < ( 1 << LATSUBBITS ) ) return b;
+	shift = ( b >> LATSUBBITS ) - 1;
+	return	( (uint64_t)( ( b & ( ( 1 << LATSUBBITS ) - 1 ) ) |
+			( 1 << LATSUBBITS ) ) << shift ) + ( 1ULL << shift ) - 1;
+}
+
+/*	latrecord - With -t, add the time from the input event at stamp
+ *	(kernel timestamp, see EVIOCSCLOCKID) until now, just after send()
+ *	returned, to the histogram. Counters are updated atomically, so
+ *	latprint may read them at any time without a lock
+ */
+void	latrecord ( uint64_t stamp )
+{
+	uint64_t	ns, max;
+	if ( ! timing || ( stamp == 0 ) ) return;
+	ns = nowstamp ();
+	ns = ( ns > stamp ) ? ns - stamp : 0;
+	__atomic_fetch_add ( &latcounts[latbucket ( ns )], 1, __ATOMIC_RELAXED );
+	max = __atomic_load_n ( &latmax, __ATOMIC_RELAXED );
+	while ( ( ns > max ) && ! __atomic_compare_exchange_n ( &latmax, &max,
+			ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {;}
+	return;
+}
+
+/*	latsnapshot - Copy the latency histogram into counts[LATBUCKETS]
+ *	and return the total number of reports in it
+ */
+uint64_t	latsnapshot ( uint64_t *counts )
+{
+	uint64_t	total = 0;
+	int	i;
+	for ( i = 0; i < LATBUCKETS; ++i )
+	{
+		counts[i] = __atomic_load_n ( &latcounts[i], __ATOMIC_RELAXED );
+		total += counts[i];
+	}
+	return	total;
+}
+
+/*	latpercentile - Return the latency (ns) below which permille/1000
+ *	of the total reports in the histogram snapshot counts are, as the
+ *	highest value of its bucket (at most the maximum seen)
+ */
+uint64_t	latpercentile ( const uint64_t *counts, uint64_t total,
+			int permille )
+{
+	uint64_t	sum = 0, max;
+	int	i;
+	max = __atomic_load_n ( &latmax, __ATOMIC_RELAXED );
+	for ( i = 0; i < LATBUCKETS; ++i )
+	{
+		sum += counts[i];
+		if ( sum * 1000 >= total * permille ) break;
+	}
+	return	( ( i < LATBUCKETS ) && ( latvalue ( i ) < max ) ) ?
+			latvalue ( i ) : max;
+}
+
+/*	latprint - Print count and p50/p99/p99.9/max of the latency
+ *	histogram on stdout. On SIGUSR1 and at exit with -t
+ */
+void	latprint ( void )
+{
+	uint64_t	counts[LATBUCKETS], total;
+	total = latsnapshot ( counts );
+	fprintf ( stdout, "Latency event->send(): %llu reports",
+			(unsigned long long)total );
+	if ( total > 0 )
+	{
+		fprintf ( stdout, ", p50 %.1f us, p99 %.1f us, p99.9 %.1f us",
+			latpercentile ( counts, total, 500 ) / 1000.0,
+			latpercentile ( counts, total, 990 ) / 1000.0,
+			latpercentile ( counts, total, 999 ) / 1000.0 );
+	}
+	fprintf ( stdout, ", max %.1f us\n",
+			__atomic_load_n ( &latmax, __ATOMIC_RELAXED ) / 1000.0 );
+	fflush ( stdout );
+	return;
+}
+
+/*
+ *	initstats (path) - create the listening statistics socket (-S) at
+ *	path, replacing a stale one. Returns its descriptor, <0 on error
+ */
+int	initstats ( char *path )
+{
+	struct sockaddr_un	sun;
+	int	fd;
+	if ( strlen ( path ) >= sizeof(sun.sun_path) )
+	{
+		fprintf ( stderr, "Statistics socket name [%s] too long\n", path );
+		return	-1;
+	}
+	memset ( &sun, 0, sizeof(sun) );
+	sun.sun_family = AF_UNIX;
+	strcpy ( sun.sun_path, path );
+	unlink ( path );
+	if ( ( 0 > ( fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+				SOCK_CLOEXEC, 0 ) ) ) ||
+	     ( 0 > bind ( fd, (struct sockaddr *)&sun, sizeof(sun) ) ) ||
+	     ( 0 > listen ( fd, 4 ) ) )
+	{
+		fprintf ( stderr, "Failed to create statistics socket [%s]: "
+				"%s\n", path, strerror ( errno ) );
+		if ( fd >= 0 ) close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+/*
+ *	servestats (fd) - answer everyone connecting to the statistics
+ *	socket fd with the current counters, then hang up. The reply is
+ *	small enough for a fresh socket buffer, so this never blocks
+ */
+void	servestats ( int fd )
+{
+	int	c;
+	while ( 0 <= ( c = accept4 ( fd, NULL, NULL, SOCK_NONBLOCK |
+						SOCK_CLOEXEC ) ) )
+	{
+		writestats ( c );
+		close ( c );
+	}
+	return;
+}
+
+/*
+ *	writestats (fd) - write the statistics to fd, one key=value pair
+ *	per line. Returns 1 on success, <0 on error
+ */
+int	writestats ( int fd )
+{
+	uint64_t	counts[LATBUCKETS], total;
+	FILE	*f;
+	char	*buf = NULL;
+	size_t	len = 0;
+	int	i, j;
+	if ( NULL == ( f = open_memstream ( &buf, &len ) ) ) return -1;
+	fprintf ( f, "uptime_s=%ld\n", (long)( time ( NULL ) - statstart ) );
+	for ( i = j = 0; i < MAXHOSTS; ++i )
+	{
+		if ( sessions[i].sint >= 0 ) ++j;
+	}
+	fprintf ( f, "connected=%d\nconnections=%lu\nprotocol=%s\nhosts=%d\n",
+			connectionok ? 1 : 0, statconns,
+			protocolmode == HIDP_PROTO_BOOT ? "boot" : "report", j );
+	fprintf ( f, "reports_sent=%lu\nbytes_sent=%lu\nsend_errors=%lu\n"
+			"send_eagain=%lu\nreports_dropped=%u\nqueue_depth=%u\n",
+			__atomic_load_n ( &statsent, __ATOMIC_RELAXED ),
+			__atomic_load_n ( &statbytes, __ATOMIC_RELAXED ),
+			__atomic_load_n ( &statsenderr, __ATOMIC_RELAXED ),
+			__atomic_load_n ( &stateagain, __ATOMIC_RELAXED ),
+			__atomic_load_n ( &repdropped, __ATOMIC_RELAXED ),
+			repqcount );
+	fprintf ( f, "resyncs=%lu\nmodifierkeys=0x%04x\nlayer=%d\n"
+			"remote=%d\n", statresyncs, modifierkeys & 0xffff,
+			neolayer ( modifierkeys ), on ? 1 : 0 );
+	fprintf ( f, "devices=%d\n", nevdevs );
+	for ( i = 0; i < evdevslen; ++i )
+	{
+		if ( ! evdevs[i].used ) continue;
+		if ( evdevs[i].num < 0 )
+		{
+			fprintf ( f, "fifo_events=%lu\n", evdevs[i].events );
+			continue;
+		}
+		fprintf ( f, "event%d_name=%s\nevent%d_events=%lu\n"
+				"event%d_grabbed=%d\n",
+				evdevs[i].num, evdevs[i].name,
+				evdevs[i].num, evdevs[i].events,
+				evdevs[i].num, evdevs[i].grabbed );
+	}
+	if ( timing )
+	{	// Non-empty buckets as highest value=count
+		total = latsnapshot ( counts );
+		fprintf ( f, "latency_count=%llu\n", (unsigned long long)total );
+		if ( total > 0 )
+		{
+			fprintf ( f, "latency_p50_ns=%llu\nlatency_p99_ns=%llu\n"
+				"latency_p999_ns=%llu\n",
+				(unsigned long long)latpercentile ( counts, total, 500 ),
+				(unsigned long long)latpercentile ( counts, total, 990 ),
+				(unsigned long long)latpercentile ( counts, total, 999 ) );
+		}
+		fprintf ( f, "latency_max_ns=%llu\n", (unsigned long long)
+				__atomic_load_n ( &latmax, __ATOMIC_RELAXED ) );
+		for ( i = 0; i < LATBUCKETS; ++i )
+		{
+			if ( counts[i] == 0 ) continue;
+			fprintf ( f, "latency_le_%llu=%llu\n",
+					(unsigned long long)latvalue ( i ),
+					(unsigned long long)counts[i] );
+		}
+	}
+	fclose ( f );
+	for ( i = 0; i < len; i += j )
+	{
+		if ( 0 >= ( j = send ( fd, buf + i, len - i, MSG_NOSIGNAL ) ) )
+			break;
+	}
+	free ( buf );
+	return	( i < len ) ? -1 : 1;
+}
+
+/*	parse_events - The event device (or fifo) fd can now be read
+ *	So retrieve data and parse it, eventually sending out a hid report!
+ *	The device is drained in batches of up to EVBATCH events per read(),
+ *	so a complete EV_MSC/EV_KEY/EV_SYN frame costs one syscall.
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	parse_events ( int fd, int sockdesc )
+{
+	int	j, k, n;
+	struct input_event	evbuf[EVBATCH];
+	struct evdev_t		*ev = &evdevs[fd];
+	do {
+		j = read ( fd, evbuf, sizeof(evbuf) );
+		if ( j == 0 )
+		{
+			if ( debugevents & 0x1 ) fprintf(stderr,".");
+			break;
+		}
+		if ( -1 == j )
+		{
+			if ( ( errno == EAGAIN ) || ( errno == EINTR ) )
+				break;
+			if ( debugevents & 0x1 )
+			{
+				if ( errno > 0 )
+				{
+					fprintf(stderr,"%d|%d(%s) (expected %d bytes). ",fd,errno,strerror(errno), (int)sizeof(struct input_event));
+				}
+				else
+				{
+					fprintf(stderr,"j=-1,errno<=0...");
+				}
+			}
+			break;
+		}
+		// exactly 24 on 64bit, (16 on 32bit): sizeof(struct input_event)
+		// A trailing partial event (fifo only) is invalid, drop it!
+		n = j / sizeof(struct input_event);
+		ev->events += n;
+		if ( NULL != recfile ) recordevents ( evbuf, n );
+		for ( k = 0; k < n; ++k )
+		{
+			if ( timing )
+			{	// CLOCK_MONOTONIC (see openevdev), fifo
+				// writers have to stamp events alike
+				evstamp = evbuf[k].input_event_sec * 1000000000ULL +
+					evbuf[k].input_event_usec * 1000ULL;
+			}
+			if ( 0 > handle_event ( ev, &evbuf[k], sockdesc ) )
+			{
+				return	-1;
+			}
+		}
+		// A full buffer means there may be more queued: read again.
+		// Devices are non-blocking, so this ends with EAGAIN.
+	} while ( j == sizeof(evbuf) );
+	// Event devices always end their frames with SYN_REPORT, which
+	// already flushed. This catches fifo writers that do not (and the
+	// translator does the same whenever it runs out of events).
+	return	pipelined ? 0 : flush_mouse ( sockdesc );
+}
+
+/*	handle_event - Pass one input event read from device ev on to
+ *	process_event, unless it belongs to a frame the kernel dropped
+ *	events from: such a frame is skipped up to its SYN_REPORT and then
+ *	the key state is read back from the devices (see resynckeys).
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	handle_event ( struct evdev_t * ev, struct input_event * inevent,
+			int sockdesc )
+{
+	if ( inevent->type == EV_SYN )
+	{
+		if ( inevent->code == SYN_DROPPED )
+		{	// Kernel buffer overflowed
+			ev->dropped = 1;
+			return	0;
+		}
+		if ( ev->dropped && ( inevent->code == SYN_REPORT ) )
+		{	// Rest of the broken frame skipped
+			ev->dropped = 0;
+			fprintf ( stdout, "Input events were dropped, key state "
+					"resynchronized.\n" );
+			++statresyncs;
+			return	pipelined ? piperesync () : resynckeys ( sockdesc );
+		}
+	}
+	if ( ev->dropped ) return 0;
+	if ( pipelined )
+	{	// Translated by the translator thread
+		return	pipeevent ( inevent );
+	}
+	return	process_event ( inevent, sockdesc );
+}
+
+/*	recordevents - With -R, append the n input events in evbuf to the
+ *	recording: per event the microseconds since the previous one, type,
+ *	code and value, see struct evrec_t
+ */
+void	recordevents ( const struct input_event * evbuf, int n )
+{
+	static uint64_t	last = 0;
+	struct evrec_t	rec;
+	uint64_t	us;
+	int	k;
+	for ( k = 0; k < n; ++k )
+	{
+		us = evbuf[k].input_event_sec * 1000000ULL +
+			evbuf[k].input_event_usec;
+		rec.delta = htole32 ( ( last == 0 ) || ( us < last ) ? 0 :
+				( us - last > UINT32_MAX ) ? UINT32_MAX : us - last );
+		last = us;
+		rec.type  = htole16 ( evbuf[k].type );
+		rec.code  = htole16 ( evbuf[k].code );
+		rec.value = htole32 ( evbuf[k].value );
+		fwrite ( &rec, sizeof(rec), 1, recfile );
+	}
+	return;
+}
+
+/*
+ *	initrecord (filename) - create recording file filename for -R.
+ *	Returns 1 on success, <0 on error
+ */
+int	initrecord ( char *filename )
+{
+	if ( NULL == ( recfile = fopen ( filename, "w" ) ) )
+	{
+		fprintf ( stderr, "Failed to create [%s]: %s\n", filename,
+				strerror ( errno ) );
+		return	-1;
+	}
+	fwrite ( EVREC_MAGIC, 1, sizeof(EVREC_MAGIC) - 1, recfile );
+	return	1;
+}
+
+/*
+ *	replay (filename, outname, fast) - feed the events recorded with -R
+ *	in filename through the translation, at the original speed or, if
+ *	fast is set, as fast as possible. No Bluetooth involved: reports
+ *	are written to outname (stdout if NULL) as hex, one per line.
+ *	Returns 0 on success, else the exit code for main
+ */
+int	replay ( char *filename, char *outname, char fast )
+{
+	FILE	*in;
+	char	magic[sizeof(EVREC_MAGIC)-1];
+	struct evrec_t	rec;
+	struct evdev_t	dev;
+	struct input_event	inevent;
+	struct timespec	ts;
+	uint64_t	due, start;
+	unsigned long	n = 0;
+	if ( NULL == ( in = fopen ( filename, "r" ) ) )
+	{
+		fprintf ( stderr, "Failed to open [%s]: %s\n", filename,
+				strerror ( errno ) );
+		return	1;
+	}
+	if ( ( 1 != fread ( magic, sizeof(magic), 1, in ) ) ||
+	     ( 0 != memcmp ( magic, EVREC_MAGIC, sizeof(magic) ) ) )
+	{
+		fprintf ( stderr, "[%s] is no hidclient recording\n", filename );
+		fclose ( in );
+		return	1;
+	}
+	repout = ( NULL == outname ) ? stdout : fopen ( outname, "w" );
+	if ( NULL == repout )
+	{
+		fprintf ( stderr, "Failed to create [%s]: %s\n", outname,
+				strerror ( errno ) );
+		fclose ( in );
+		return	1;
+	}
+	memset ( &dev, 0, sizeof(dev) );
+	dev.used = 1;
+	dev.num = -1;
+	memset ( &inevent, 0, sizeof(inevent) );
+	connectionok = 1;
+	on = 1;
+	due = start = nowstamp ();
+	while ( 1 == fread ( &rec, sizeof(rec), 1, in ) )
+	{
+		due += le32toh ( rec.delta ) * 1000ULL;
+		if ( ! fast && ( due > nowstamp () ) )
+		{	// Keep the original pace
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+		}
+		// Stamped when fed in, so -t measures the translation
+		evstamp = nowstamp ();
+		inevent.input_event_sec = evstamp / 1000000000ULL;
+		inevent.input_event_usec = evstamp % 1000000000ULL / 1000;
+		inevent.type  = le16toh ( rec.type );
+		inevent.code  = le16toh ( rec.code );
+		inevent.value = (int32_t)le32toh ( rec.value );
+		handle_event ( &dev, &inevent, -1 );
+		++n;
+	}
+	flush_mouse ( -1 );
+	due = nowstamp () - start;
+	fprintf ( stderr, "Replayed %lu events, %lu reports in %.3f s "
+			"(%.0f events/s, %.1f ns/event)\n", n, statsent,
+			due / 1e9, due ? n * 1e9 / due : 0.0,
+			n ? (double)due / n : 0.0 );
+	fclose ( in );
+	if ( repout != stdout ) fclose ( repout );
+	repout = NULL;
+	return	0;
+}
+
+/*	writereport - In replay mode (-P), write report rep of len bytes
+ *	to the output file as hex, instead of sending it
+ */
+void	writereport ( const void * rep, int len )
+{
+	static const char	hex[] = "0123456789abcdef";
+	char	line[3 * REPMAXLEN + 1];
+	int	i;
+	for ( i = 0; i < len; ++i )
+	{
+		line[3*i]   = hex[((const unsigned char *)rep)[i] >> 4];
+		line[3*i+1] = hex[((const unsigned char *)rep)[i] & 0xf];
+		line[3*i+2] = ' ';
+	}
+	line[3*len-1] = '\n';
+	fwrite ( line, 3 * len, 1, repout );
+	return;
+}
+
+/*
+ *	spsc_init (r, slots, size) - set up ring r with slots (a power of 2)
+ *	slots of size bytes. One thread fills it (spsc_slot, spsc_push),
+ *	another one empties it (spsc_peek, spsc_pop), without locks.
+ *	Returns 1 on success, <0 on error
+ */
+int	spsc_init ( struct spsc_t * r, unsigned int slots, unsigned int size )
+{
+	memset ( r, 0, sizeof(*r) );
+	r->mask = slots - 1;
+	r->size = size;
+	if ( ( NULL == ( r->slots = calloc ( slots, size ) ) ) ||
+	     ( 0 > ( r->wakefd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) ) )
+	{
+		fprintf ( stderr, "Failed to set up pipeline ring: %s\n",
+				strerror ( errno ) );
+		return	-1;
+	}
+	return	1;
+}
+
+// Producer: free slot to fill in, NULL if the ring is full
+void	*spsc_slot ( struct spsc_t * r )
+{
+	if ( r->head - __atomic_load_n ( &r->tail, __ATOMIC_ACQUIRE ) > r->mask )
+		return	NULL;
+	return	r->slots + ( r->head & r->mask ) * r->size;
+}
+
+// Producer: hand the slot from spsc_slot to the consumer, waking it
+void	spsc_push ( struct spsc_t * r )
+{
+	uint64_t	one = 1;
+	__atomic_store_n ( &r->head, r->head + 1, __ATOMIC_RELEASE );
+	__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+	if ( __atomic_load_n ( &r->sleeping, __ATOMIC_RELAXED ) )
+	{
+		if ( write ( r->wakefd, &one, sizeof(one) ) ) {;}
+	}
+	return;
+}
+
+// Consumer: oldest filled slot, NULL if the ring is empty
+void	*spsc_peek ( struct spsc_t * r )
+{
+	if ( r->tail == __atomic_load_n ( &r->head, __ATOMIC_ACQUIRE ) )
+		return	NULL;
+	return	r->slots + ( r->tail & r->mask ) * r->size;
+}
+
+// Consumer: done with the slot from spsc_peek
+void	spsc_pop ( struct spsc_t * r )
+{
+	__atomic_store_n ( &r->tail, r->tail + 1, __ATOMIC_RELEASE );
+	return;
+}
+
+/*
+ *	spsc_sleep (r, fd, events, timeout) - Consumer: wait until the ring
+ *	is not empty or, if fd >= 0, until fd reports events or anyone
+ *	writes r->wakefd. Polls the ring for a while before sleeping.
+ *	Waits at most timeout ms (<0: no limit)
+ */
+void	spsc_sleep ( struct spsc_t * r, int fd, short events, int timeout )
+{
+	struct pollfd	pfd[2];
+	uint64_t	v;
+	int	i;
+	for ( i = 0; ( fd < 0 ) && ( i < PIPESPIN ); ++i )
+	{
+		if ( NULL != spsc_peek ( r ) ) return;
+	}
+	__atomic_store_n ( &r->sleeping, 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+	if ( ( fd >= 0 ) || ( NULL == spsc_peek ( r ) ) )
+	{	// Nothing pushed since the check: sleep
+		pfd[0].fd = r->wakefd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = fd;
+		pfd[1].events = events;
+		poll ( pfd, ( fd >= 0 ) ? 2 : 1, timeout );
+	}
+	__atomic_store_n ( &r->sleeping, 0, __ATOMIC_RELAXED );
+	if ( read ( r->wakefd, &v, sizeof(v) ) ) {;}
+	return;
+}
+
+/*
+ *	parsecpus (list) - parse the argument of -p: up to three CPU numbers,
+ *	separated by commas, for the reader, translator and transmitter
+ *	(-1 or nothing: not pinned). Returns 1 on success, <0 on error
+ */
+int	parsecpus ( char * list )
+{
+	char	*end;
+	int	i;
+	for ( i = 0; ( i < 3 ) && ( *list != 0 ); ++i )
+	{
+		pipecpus[i] = strtol ( list, &end, 10 );
+		if ( ( end == list ) || ( ( *end != ',' ) && ( *end != 0 ) ) )
+		{
+			fprintf ( stderr, "Invalid CPU list for -p\n" );
+			return	-1;
+		}
+		list = end + ( *end == ',' );
+	}
+	return	1;
+}
+
+// Pin thread t to CPU cpu, unless cpu < 0
+void	pincpu ( pthread_t t, int cpu )
+{
+	cpu_set_t	set;
+	if ( cpu < 0 ) return;
+	CPU_ZERO ( &set );
+	CPU_SET ( cpu, &set );
+	if ( 0 != pthread_setaffinity_np ( t, sizeof(set), &set ) )
+	{
+		fprintf ( stderr, "Failed to pin thread to CPU %d\n", cpu );
+	}
+	return;
+}
+
+/*
+ *	pipestart () - with -p, start the translator and transmitter threads
+ *	and pin all three stages. The main thread stays the reader, and
+ *	keeps handling devices, connections and everything else.
+ *	Returns 1 on success, <0 on error
+ */
+int	pipestart ( void )
+{
+	if ( ( 0 > spsc_init ( &evring, PIPEEVENTS,
+				sizeof(struct input_event) ) ) ||
+	     ( 0 > spsc_init ( &repring, PIPEREPORTS,
+				sizeof(struct hidrep_slot_t) ) ) ||
+	     ( 0 > ( pipenotifyfd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) ) ||
+	     ( 0 > evloop_add ( pipenotifyfd, EVL_PIPE ) ) )
+	{
+		return	-1;
+	}
+	pipelined = 1;
+	if ( ( 0 != pthread_create ( &pipethreads[0], NULL, translator, NULL ) ) ||
+	     ( 0 != pthread_create ( &pipethreads[1], NULL, transmitter, NULL ) ) )
+	{
+		fprintf ( stderr, "Failed to start pipeline threads\n" );
+		exit ( 1 );
+	}
+	pincpu ( pthread_self (), pipecpus[0] );
+	pincpu ( pipethreads[0], pipecpus[1] );
+	pincpu ( pipethreads[1], pipecpus[2] );
+	return	1;
+}
+
+// Shut the pipeline down, after everything queued has been sent
+void	pipestop ( void )
+{
+	struct input_event	*e;
+	uint64_t	one = 1;
+	if ( ! pipelined ) return;
+	// A channel still congested now will not be waited for
+	__atomic_store_n ( &pipestopping, 1, __ATOMIC_RELEASE );
+	if ( write ( repring.wakefd, &one, sizeof(one) ) ) {;}
+	while ( NULL == ( e = spsc_slot ( &evring ) ) ) sched_yield ();
+	e->type = EVP_STOP;
+	spsc_push ( &evring );
+	pthread_join ( pipethreads[0], NULL );
+	pthread_join ( pipethreads[1], NULL );
+	pipelined = 0;
+	return;
+}
+
+/*
+ *	pipeevent (inevent) - Reader: pass inevent on to the translator.
+ *	If the ring is full, wait: the translator is much faster than any
+ *	input device, and the kernel buffers meanwhile (see SYN_DROPPED).
+ *	Returns 0
+ */
+int	pipeevent ( const struct input_event * inevent )
+{
+	struct input_event	*e;
+	while ( NULL == ( e = spsc_slot ( &evring ) ) ) sched_yield ();
+	*e = *inevent;
+	spsc_push ( &evring );
+	return	0;
+}
+
+// Reader: pass the keys now held on to the translator, see resynckeys
+int	piperesync ( void )
+{
+	unsigned long	held[NLONGS(KEY_MAX)];
+	struct input_event	e;
+	int	w;
+	heldkeys ( held );
+	memset ( &e, 0, sizeof(e) );
+	e.type = EVP_RESYNC;
+	for ( w = 0; w * 32 <= KEY_MAX; ++w )
+	{
+		e.code = w;
+		e.value = held[w*32/LONGBITS] >> ( w * 32 % LONGBITS );
+		pipeevent ( &e );
+	}
+	e.code = EVP_RESYNCEND;
+	return	pipeevent ( &e );
+}
+
+/*
+ *	pipelayout (layout) - Reader: hand a layout read by readlayout to the
+ *	translator, which makes it active between two frames (EVP_LAYOUT)
+ *	and frees the previous one once it no longer looks keys up there
+ */
+void	pipelayout ( void * layout )
+{
+	struct input_event	e;
+	void	*old;
+	old = __atomic_exchange_n ( &layoutnext, layout, __ATOMIC_ACQ_REL );
+	free ( old );	// Never taken over
+	memset ( &e, 0, sizeof(e) );
+	e.type = EVP_LAYOUT;
+	pipeevent ( &e );
+	return;
+}
+
+/*
+ *	pipereport (rep, len) - Translator: pass a report on to the
+ *	transmitter. With the ring full (congested radio) mouse reports
+ *	are dropped and the newest keyboard state is kept aside until there
+ *	is room, like sendreport does with its queue. Returns 0
+ */
+int	pipereport ( const void * rep, int len )
+{
+	struct hidrep_slot_t	*slot;
+	pipeflushkeyb ();
+	if ( ( pipekeyb.len > 0 ) || ( NULL == ( slot = spsc_slot ( &repring ) ) ) )
+	{
+		__atomic_fetch_add ( &repdropped, 1, __ATOMIC_RELAXED );
+		if ( ((const unsigned char *)rep)[1] != keybreportid () )
+			return	0;
+		slot = &pipekeyb;
+	}
+	memcpy ( slot->data, rep, len );
+	slot->len = len;
+	slot->stamp = evstamp;
+	if ( slot != &pipekeyb ) spsc_push ( &repring );
+	return	0;
+}
+
+// Translator: pass the keyboard report kept aside on, if there is room
+void	pipeflushkeyb ( void )
+{
+	struct hidrep_slot_t	*slot;
+	if ( ( pipekeyb.len == 0 ) ||
+	     ( NULL == ( slot = spsc_slot ( &repring ) ) ) )
+		return;
+	*slot = pipekeyb;
+	spsc_push ( &repring );
+	pipekeyb.len = 0;
+	return;
+}
+
+/*
+ *	pipesession (sock, fresh, release, nrelease) - Main thread: the
+ *	input goes to the connection sock from now on (none if sock < 0).
+ *	With fresh, the translator starts over with no keys pressed,
+ *	otherwise it only sends the next keyboard report even if it looks
+ *	unchanged. The change travels with the data: the translator marks it
+ *	in repring (pipehandoff), so the transmitter sends everything before
+ *	to the previous host, then the nrelease reports in release, and only
+ *	then switches. It gets its own descriptor, so it can never send to a
+ *	reused one.
+ */
+void	pipesession ( int sock, char fresh, const struct hidrep_slot_t * release,
+			int nrelease )
+{
+	struct input_event	e;
+	struct txhandoff_t	*h;
+	uint64_t	one = 1;
+	while ( __atomic_load_n ( &txpending, __ATOMIC_ACQUIRE ) >= TXHANDOFFS )
+	{	// Never for long, see transmitter
+		sched_yield ();
+	}
+	h = &txhandoffs[txhandoffseq % TXHANDOFFS];
+	h->sock = ( sock >= 0 ) ? dup ( sock ) : -1;
+	h->nrelease = nrelease;
+	if ( nrelease > 0 )
+		memcpy ( h->release, release, nrelease * sizeof(*release) );
+	__atomic_add_fetch ( &txpending, 1, __ATOMIC_ACQ_REL );
+	memset ( &e, 0, sizeof(e) );
+	e.type = fresh ? EVP_RESET : EVP_FOCUS;
+	e.value = txhandoffseq++ % TXHANDOFFS;
+	pipeevent ( &e );
+	// A transmitter waiting on the old host's channel drops what is left
+	if ( write ( repring.wakefd, &one, sizeof(one) ) ) {;}
+	return;
+}
+
+// Translator: mark host change entry n in repring, see pipesession
+void	pipehandoff ( int n )
+{
+	struct hidrep_slot_t	*slot;
+	while ( NULL == ( slot = spsc_slot ( &repring ) ) ) sched_yield ();
+	slot->len = REPHANDOFF;
+	slot->stamp = n;
+	spsc_push ( &repring );
+	return;
+}
+
+// Pipeline threads: wake the main loop, to look at their requests
+void	pipenotify ( void )
+{
+	uint64_t	one = 1;
+	if ( write ( pipenotifyfd, &one, sizeof(one) ) ) {;}
+	return;
+}
+
+/*
+ *	piperequests (fd) - Main thread: handle what the pipeline threads
+ *	cannot do themselves, as it belongs to the main thread: (un)grab
+ *	the devices, close a broken connection
+ */
+void	piperequests ( int fd )
+{
+	uint64_t	v;
+	int	grab;
+	if ( read ( fd, &v, sizeof(v) ) ) {;}
+	if ( 0 <= ( grab = __atomic_exchange_n ( &grabrequest, -1,
+					__ATOMIC_ACQ_REL ) ) )
+	{
+		grabevents ( grab );
+	}
+	if ( __atomic_load_n ( &txbroken, __ATOMIC_ACQUIRE ) &&
+	     ( 0 == __atomic_load_n ( &txpending, __ATOMIC_ACQUIRE ) ) )
+	{	// Not some earlier host's connection
+		connectionok = 0;
+	}
+	return;
+}
+
+// grabevents (see there) from wherever PRINT was handled
+void	requestgrab ( int grab )
+{
+	if ( ! pipelined )
+	{
+		grabevents ( grab );
+		return;
+	}
+	__atomic_store_n ( &grabrequest, grab, __ATOMIC_RELEASE );
+	pipenotify ();
+	return;
+}
+
+/*
+ *	translator - Pipeline thread translating the input events from the
+ *	reader into reports for the transmitter (process_event). It owns
+ *	the key and mouse state; -1 as socket makes sendreport use the ring.
+ */
+void	*translator ( void * arg )
+{
+	static unsigned long	held[NLONGS(KEY_MAX)];
+	struct input_event	*e;
+	struct hidrep_slot_t	*slot;
+	void			*layout;
+	while ( 1 )
+	{
+		while ( NULL != ( e = spsc_peek ( &evring ) ) )
+		{
+			switch ( e->type )
+			{
+			  case	EVP_STOP:
+				spsc_pop ( &evring );
+				flush_mouse ( -1 );
+				while ( pipekeyb.len > 0 )
+				{
+					pipeflushkeyb ();
+					sched_yield ();
+				}
+				while ( NULL == ( slot = spsc_slot ( &repring ) ) )
+					sched_yield ();
+				slot->len = 0;	// Stop the transmitter
+				spsc_push ( &repring );
+				return	NULL;
+			  case	EVP_RESET:
+				memset ( pressedbits, 0, sizeof(pressedbits) );
+				modifierkeys = 0;
+				mousebuttons = 0;
+				mousedx = mousedy = mousedz = 0;
+				mousedirty = 0;
+				maskedmods = 0;
+				setlastkeyb ( NULL, 0 );
+				pipekeyb.len = 0;
+				pipehandoff ( e->value );
+				break;
+			  case	EVP_FOCUS:	// See switchfocus
+				maskedmods = modifierkeys & REALMODS;
+				setlastkeyb ( NULL, 0 );
+				pipekeyb.len = 0;
+				pipehandoff ( e->value );
+				break;
+			  case	EVP_LAYOUT:
+				if ( NULL != ( layout = __atomic_exchange_n (
+					&layoutnext, NULL, __ATOMIC_ACQ_REL ) ) )
+					setlayout ( layout );
+				break;
+			  case	EVP_RESYNC:
+				if ( e->code != EVP_RESYNCEND )
+				{
+					held[e->code*32/LONGBITS] &= ~( 0xffffffffUL <<
+						( e->code * 32 % LONGBITS ) );
+					held[e->code*32/LONGBITS] |= (unsigned long)
+						(uint32_t)e->value <<
+						( e->code * 32 % LONGBITS );
+					break;
+				}
+				applykeys ( held, -1 );
+				break;
+			  default:
+				if ( timing )
+				{	// See parse_events
+					evstamp = e->input_event_sec * 1000000000ULL +
+						e->input_event_usec * 1000ULL;
+				}
+				process_event ( e, -1 );
+			}
+			spsc_pop ( &evring );
+		}
+		// Idle: end of a frame if the fifo writer did not say so
+		flush_mouse ( -1 );
+		pipeflushkeyb ();
+		spsc_sleep ( &evring, -1, 0, pipekeyb.len > 0 ? 1 : -1 );
+	}
+}
+
+/*
+ *	txreleased (sock, h) - Transmitter: the input goes to another host
+ *	(host change h); send the all-released reports (see switchfocus) to
+ *	the one on sock, after all reports it got before. It gets
+ *	RELEASEWAIT to take them.
+ */
+void	txreleased ( int sock, const struct txhandoff_t * h )
+{
+	struct pollfd	pfd = { sock, POLLOUT, 0 };
+	int	i;
+	for ( i = 0; i < h->nrelease; ++i )
+	{
+		if ( ( 0 >= send ( sock, h->release[i].data, h->release[i].len,
+				MSG_NOSIGNAL ) ) &&
+		     ( ( errno != EAGAIN ) ||
+		       ( 0 >= poll ( &pfd, 1, RELEASEWAIT ) ) ||
+		       ( 0 >= send ( sock, h->release[i].data,
+				h->release[i].len, MSG_NOSIGNAL ) ) ) )
+			return;
+	}
+	return;
+}
+
+/*
+ *	transmitter - Pipeline thread sending the reports from the
+ *	translator. Waits for a congested channel by itself, so neither
+ *	reading nor translating ever stalls on the radio.
+ */
+void	*transmitter ( void * arg )
+{
+	struct hidrep_slot_t	*slot;
+	const struct txhandoff_t	*h;
+	int	sock = -1;
+	while ( 1 )
+	{
+		if ( NULL == ( slot = spsc_peek ( &repring ) ) )
+		{
+			spsc_sleep ( &repring, -1, 0, -1 );
+			continue;
+		}
+		if ( slot->len == 0 )
+		{	// EVP_STOP
+			spsc_pop ( &repring );
+			if ( sock >= 0 ) close ( sock );
+			return	NULL;
+		}
+		if ( slot->len == REPHANDOFF )
+		{	// Another connection, or none at all (pipesession)
+			h = &txhandoffs[slot->stamp];
+			if ( sock >= 0 )
+			{
+				txreleased ( sock, h );
+				close ( sock );
+			}
+			sock = h->sock;
+			spsc_pop ( &repring );
+			__atomic_store_n ( &txbroken, 0, __ATOMIC_RELEASE );
+			__atomic_sub_fetch ( &txpending, 1, __ATOMIC_ACQ_REL );
+			continue;
+		}
+		if ( ( sock < 0 ) ||
+		     ( 0 < send ( sock, slot->data, slot->len, MSG_NOSIGNAL ) ) )
+		{
+			if ( sock >= 0 )
+			{
+				latrecord ( slot->stamp );
+				__atomic_fetch_add ( &statsent, 1,
+						__ATOMIC_RELAXED );
+				__atomic_fetch_add ( &statbytes, slot->len,
+						__ATOMIC_RELAXED );
+			}
+			spsc_pop ( &repring );
+			continue;
+		}
+		if ( __atomic_load_n ( &txpending, __ATOMIC_ACQUIRE ) )
+		{	// The host loses the input anyway: do not wait for it,
+			// it gets the release reports (txreleased)
+			if ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) )
+			{
+				__atomic_fetch_add ( &repdropped, 1,
+						__ATOMIC_RELAXED );
+				spsc_pop ( &repring );
+				continue;
+			}
+			__atomic_fetch_add ( &statsenderr, 1, __ATOMIC_RELAXED );
+			close ( sock );
+			sock = -1;
+			continue;
+		}
+		if ( ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) ) &&
+		     ! __atomic_load_n ( &pipestopping, __ATOMIC_ACQUIRE ) )
+		{	// Congested: wait until writable (or a host change)
+			__atomic_fetch_add ( &stateagain, 1, __ATOMIC_RELAXED );
+			spsc_sleep ( &repring, sock, POLLOUT, -1 );
+			continue;
+		}
+		__atomic_fetch_add ( &statsenderr, 1, __ATOMIC_RELAXED );
+		close ( sock );
+		sock = -1;
+		__atomic_store_n ( &txbroken, 1, __ATOMIC_RELEASE );
+		pipenotify ();
+	}
+}
+
+/*	flush_mouse - Send the mouse motion and buttons collected since the
+ *	last flush as one report. Deltas beyond the +-127 range of a report
+ *	are split across several reports, so no motion is lost.
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	flush_mouse ( int sockdesc )
+{
+	struct hidrep_mouse_t	evmouse;
+	struct hidrep_bootmouse_t	evboot;
+	if ( ! mousedirty ) return 0;
+	mousedirty = 0;
+	if ( __atomic_load_n ( &protocolmode, __ATOMIC_RELAXED ) ==
+			HIDP_PROTO_BOOT )
+	{	// Boot mouse: no scroll wheel
+		mousedz = 0;
+		evboot.btcode = 0xA1;
+		evboot.rep_id = BOOTID_MOUSE;
+		evboot.button = mousebuttons & 0x07;
+		do {
+			evboot.axis_x = CLAMPREL ( mousedx );
+			evboot.axis_y = CLAMPREL ( mousedy );
+			mousedx -= evboot.axis_x;
+			mousedy -= evboot.axis_y;
+			if ( ! connectionok ) continue;
+			if ( 0 > sendreport ( sockdesc, &evboot,
+					sizeof(struct hidrep_bootmouse_t) ) )
+			{
+				mousedx = mousedy = 0;
+				return	-1;
+			}
+		} while ( mousedx || mousedy );
+		return	0;
+	}
+	evmouse.btcode = 0xA1;
+	evmouse.rep_id = REPORTID_MOUSE;
+	evmouse.button = mousebuttons & 0x07;
+	do {
+		evmouse.axis_x = CLAMPREL ( mousedx );
+		evmouse.axis_y = CLAMPREL ( mousedy );
+		evmouse.axis_z = CLAMPREL ( mousedz );
+		mousedx -= evmouse.axis_x;
+		mousedy -= evmouse.axis_y;
+		mousedz -= evmouse.axis_z;
+		if ( ! connectionok ) continue;
+		if ( 0 > sendreport ( sockdesc, &evmouse,
+				sizeof(struct hidrep_mouse_t) ) )
+		{
+			mousedx = mousedy = mousedz = 0;
+			return	-1;
+		}
+	} while ( mousedx || mousedy || mousedz );
+	return	0;
+}
+
+/*	keymodifier - Return the modifierkeys bit(s) for key code, 0 for keys
+ *	that are no modifier. 0x8000 marks a real modifier, sent along as
+ *	such; the others only select the Neo layer (see neolayer)
+ */
+int	keymodifier ( int code )
+{
+	switch ( code )
+	{
+	  case	KEY_RIGHTMETA:	return	0x8080;
+	  case	KEY_RIGHTCTRL:	return	0x8010;
+	  case	KEY_LEFTMETA:	return	0x8008;
+	  case	KEY_LEFTALT:	return	0x8004;
+	  case	KEY_LEFTCTRL:	return	0x8001;
+	  case	KEY_LEFTSHIFT:	return	0x0002;	// layer 2
+	  case	KEY_RIGHTALT:	return	0x0040;	// mod4
+	  case	KEY_RIGHTSHIFT:	return	0x0020;	// layer 2
+	  case	KEY_CAPSLOCK:	return	0x0100;	// mod3
+	  case	KEY_BACKSLASH:	return	0x0200;	// mod3 (#)
+	  case	KEY_102ND:	return	0x0400;	// mod4 (<)
+	}
+	return	0;
+}
+
+/*	neolayer - Return the Neo layer (0..5) selected by the modifierkeys
+ *	bits mods: shift, mod3, mod4, shift+mod3 and mod3+mod4
+ */
+int	neolayer ( int mods )
+{
+	int	layermod = 0;
+	if ( mods & 0x0022 ) layermod |= 0x01;
+	if ( mods & 0x0300 ) layermod |= 0x02;
+	if ( mods & 0x0440 ) layermod |= 0x04;
+	if ( ( layermod & 0x06 ) == 0x06 ) return 5;
+	if ( ( layermod & 0x03 ) == 0x03 ) return 4;
+	if ( layermod & 0x04 ) return 3;
+	if ( layermod & 0x02 ) return 2;
+	return	layermod & 0x01;
+}
+
+/*	lookupkey - Return the HID usage to send for usage u on layer,
+ *	0 if the key sends nothing there. Keys beyond the layout are sent
+ *	as they are, without modifiers. If a key is sent, the modifier
+ *	byte to go with it is stored in *mod. u 0 (modifiers, keys without
+ *	usage) sends nothing and leaves *mod alone, whatever a layout file
+ *	has in row 0
+ */
+unsigned char	lookupkey ( unsigned char u, int layer, unsigned char *mod )
+{
+	const unsigned char	*entry;
+	if ( u == 0 ) return 0;
+	if ( u >= layoutrows )
+	{
+		*mod = 0;
+		return	u;
+	}
+	if ( layer >= layoutlayers ) return 0;
+	entry = layouttab + ( u * layoutlayers + layer ) * 2;
+	if ( entry[1] ) *mod = entry[0];
+	return	entry[1];
+}
+
+/*	resynckeys - After the kernel dropped events (SYN_DROPPED) or the
+ *	layout changed (reloadlayout), rebuild modifierkeys, pressedbits
+ *	and mousebuttons from the keys actually held on all devices
+ *	(EVIOCGKEY) and send one corrected keyboard report and mouse report.
+ *	Keys still held are looked up on the current layer, as the one they
+ *	were pressed on is unknown.
  *	Return value <0 means connection broke and shall be disconnected
  */
-int	parse_events ( fd_set * efds, int sockdesc )
+int	resynckeys ( int sockdesc )
 {
-	int	i, j;
+	unsigned long	held[NLONGS(KEY_MAX)];
+	heldkeys ( held );
+	return	applykeys ( held, sockdesc );
+}
+
+// Collect the keys held on all devices (EVIOCGKEY) into held
+void	heldkeys ( unsigned long * held )
+{
+	unsigned long	keys[NLONGS(KEY_MAX)];
+	int	i, k;
+	memset ( held, 0, sizeof(keys) );
+	for ( i = 0; i < evdevslen; ++i )
+	{
+		if ( ! evdevs[i].used || ( evdevs[i].num < 0 ) ) continue;
+		if ( 0 > ioctl ( i, EVIOCGKEY(sizeof(keys)), keys ) ) continue;
+		for ( k = 0; k < NLONGS(KEY_MAX); ++k )
+		{
+			held[k] |= keys[k];
+		}
+	}
+	return;
+}
+
+// Second half of resynckeys: rebuild the state from held and report it
+int	applykeys ( const unsigned long * held, int sockdesc )
+{
+	unsigned char	hidrep[REPMAXLEN];
+	unsigned char	mod, c;
+	int	i, layer;
+	modifierkeys = 0;
+	for ( i = 0; i < BTN_MISC; ++i )
+	{
+		if ( TESTBIT ( held, i ) ) modifierkeys |= keymodifier ( i );
+	}
+	maskedmods &= modifierkeys;
+	mousebuttons = ( TESTBIT ( held, BTN_LEFT ) ? 0x01 : 0 ) |
+			( TESTBIT ( held, BTN_RIGHT ) ? 0x02 : 0 ) |
+			( TESTBIT ( held, BTN_MIDDLE ) ? 0x04 : 0 );
+	mousedirty = 1;
+	layer = neolayer ( modifierkeys );
+	mod = (char) modifierkeys & ~maskedmods;
+	memset ( pressedbits, 0, sizeof(pressedbits) );
+	for ( i = 0; i < BTN_MISC; ++i )
+	{
+		if ( ! TESTBIT ( held, i ) || keymodifier ( i ) ) continue;
+		if ( 0 != ( c = lookupkey ( keyusage[i], layer, &mod ) ) )
+		{
+			pressedbits[c >> 3] |= 1 << ( c & 7 );
+		}
+	}
+	if ( connectionok && on &&
+	     ( 0 > sendreport ( sockdesc, hidrep,
+			keyreport ( hidrep, mod, pressedbits ) ) ) )
+	{
+		return	-1;
+	}
+	return	flush_mouse ( sockdesc );
+}
+
+/*	process_event - Translate a single input event, eventually sending out
+ *	a hid report on sockdesc.
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	process_event ( struct input_event * inevent, int sockdesc )
+{
+	int	j = 1;
 	signed char	c;
 	unsigned char	u;
 
@@ -877,477 +4246,230 @@ int	parse_events ( fd_set * efds, int sockdesc )
     unsigned char mod = 0;
     unsigned char printchar = 0;
     unsigned short  pressedmod = 0;
-    unsigned char layermod = 0;
-
-	char	buf[sizeof(struct input_event)];
-	char	hidrep[32]; // mouse ~6, keyboard ~11 chars
-	struct input_event    * inevent = (void *)buf;
-	struct hidrep_mouse_t * evmouse = (void *)hidrep;
-	struct hidrep_keyb_t  * evkeyb  = (void *)hidrep;
-	if ( efds == NULL ) { return -1; }
-	for ( i = 0; i < MAXEVDEVS; ++i )
-	{
-		if ( 0 > eventdevs[i] ) continue;
-		if ( ! ( FD_ISSET ( eventdevs[i], efds ) ) ) continue;
-		j = read ( eventdevs[i], buf, sizeof(struct input_event) );
-		if ( j == 0 )
-		{
-			if ( debugevents & 0x1 ) fprintf(stderr,".");
-			continue;
-		}
-		if ( -1 == j )
-		{
-			if ( debugevents & 0x1 )
-			{
-				if ( errno > 0 )
-				{
-					fprintf(stderr,"%d|%d(%s) (expected %d bytes). ",eventdevs[i],errno,strerror(errno), (int)sizeof(struct input_event));
-				}
-				else
-				{
-					fprintf(stderr,"j=-1,errno<=0...");
-				}
-			}
-			continue;
-		}
-		if ( sizeof(struct input_event) > j )
-		{
-			// exactly 24 on 64bit, (16 on 32bit): sizeof(struct input_event)
-			//  chars expected != got: data invalid, drop it!
-			continue;
+
+	unsigned char	hidrep[REPMAXLEN];
+	unsigned char	bits[sizeof(pressedbits)];
+	if ( debugevents & 0x1 )
+		fprintf ( stdout, "EVENT{%04X %04X %08X}\n", inevent->type,
+		  inevent->code, inevent->value );
+	switch ( inevent->type )
+	{
+	  case	EV_SYN:
+		if ( inevent->code == SYN_REPORT )
+		{	// End of frame: one mouse report for all of it
+			return	flush_mouse ( sockdesc );
 		}
-		//fprintf(stderr,"   read(%d)from(%d)   ", j, i );
-		if ( debugevents & 0x1 )
-			fprintf ( stdout, "EVENT{%04X %04X %08X}\n", inevent->type,
-			  inevent->code, inevent->value );
-		switch ( inevent->type )
-		{
-		  case	EV_SYN:
-			break;
-		  case	EV_KEY:
-			u = 1; // Modifier keys
+		break;
+	  case	EV_KEY:
+		// HID usage (and chars[] row) for a regular key, 0 for others
+		u = ( inevent->code <= KEY_MAX ) ? keyusage[inevent->code] : 0;
 
             mod = 0;
             layer = 0;
             pressedmod = 0;
-            layermod = 0;
 
-			switch ( inevent->code )
+		switch ( inevent->code )
+		{
+		  // *** Mouse button events
+		  case	BTN_LEFT:
+		  case	BTN_RIGHT:
+		  case	BTN_MIDDLE:
+			c = 1 << (inevent->code & 0x03);
+			mousebuttons = mousebuttons & (0x07-c);
+			if ( inevent->value == 1 )
+			// Key has been pressed DOWN
+			{
+				mousebuttons=mousebuttons | c;
+			}
+			// Sent along with the motion of this frame
+			mousedirty = 1;
+			break;
+		  // *** Special key: PRINT
+		  case	KEY_SYSRQ:	
+			// When pressed: abort connection
+			if ( inevent->value == 0 )
 			{
-			  // *** Mouse button events
-			  case	BTN_LEFT:
-			  case	BTN_RIGHT:
-			  case	BTN_MIDDLE:
-				c = 1 << (inevent->code & 0x03);
-				mousebuttons = mousebuttons & (0x07-c);
-				if ( inevent->value == 1 )
-				// Key has been pressed DOWN
-				{
-					mousebuttons=mousebuttons | c;
-				}
-				evmouse->btcode = 0xA1;
-				evmouse->rep_id = REPORTID_MOUSE;
-				evmouse->button = mousebuttons & 0x07;
-				evmouse->axis_x =
-				evmouse->axis_y =
-				evmouse->axis_z = 0;
-				if ( ! connectionok )
-					break;
-				j = send ( sockdesc, evmouse,
-					sizeof(struct hidrep_mouse_t),
-					MSG_NOSIGNAL );
-				if ( 1 > j )
-				{
-					return	-1;
-				}
-				break;
-			  // *** Special key: PRINT
-			  case	KEY_SYSRQ:	
-				// When pressed: abort connection
-				if ( inevent->value == 0 )
-				{
 
-				    // If also LCtrl pressed:
-				    // Terminate program
-				    if (( modifierkeys & 0x1 ) == 0x1 )
-				    {
+			    // If also LCtrl pressed:
+			    // Terminate program
+			    if (( modifierkeys & 0x1 ) == 0x1 )
+			    {
                       if ( connectionok )
-				      {
-					    evkeyb->btcode=0xA1;
-					    evkeyb->rep_id=REPORTID_KEYBD;
-                        memset ( evkeyb->key, 0, 8 );
-				        evkeyb->modify = 0;
-					    j = send ( sockdesc, evkeyb,
-					    sizeof(struct hidrep_keyb_t),
-					    MSG_NOSIGNAL );
-				      }
-                      sprintf ( result, "xinput set-int-prop %d \"Device "\
-					  "Enabled\" 8 1", id);
-					  if ( system ( result ) )
-					  {
-					    fprintf ( stderr, "Failed to x11-mute or x11-unmute.\n" );
-					  }
-					  exit(0);//return	-99;
-				    }
+			      {
+				    memset ( bits, 0, sizeof(bits) );
+				    j = sendreport ( sockdesc, hidrep,
+				    keyreport ( hidrep, 0, bits ) );
+			      }
+				  if ( pipelined )
+				  {	// Translator thread: let the main loop
+					// shut down, after the report went out
+					prepareshutdown = 1;
+					pipenotify ();
+					break;
+				  }
+				  // Closing the devices ends any grab
+				  exit(0);//return	-99;
+			    }
+
+			    // If also LAlt pressed:
+			    // Input goes to the next connected host
+			    if (( modifierkeys & 0x4 ) == 0x4 )
+			    {
+				  requestfocus ();
+				  break;
+			    }
 
                     //if RCtrl pressed:
                     //send defined password to device
                     if (( modifierkeys & 0x10 ) == 0x10 )
-				    {
+			    {
                       int i;
                       for(i=0;i<ARRAY;i++) {
 
                        mod = pass[i][0];
-                       pressedkey[0] = pass[i][1];
-
-                       evkeyb->btcode = 0xA1;
-				       evkeyb->rep_id = REPORTID_KEYBD;
-                       memcpy ( evkeyb->key, pressedkey, 8 );
-				       evkeyb->modify = mod;
-                       //printf("\nsend mod: 0x%08x, pressedkey: %u,%u,%u,%u,%u,%u,%u,%u",mod,pressedkey[0],pressedkey[1],pressedkey[2],pressedkey[3],pressedkey[4],pressedkey[5],pressedkey[6],pressedkey[7]);
-				       if ( ! connectionok ) break;
+                       memset ( bits, 0, sizeof(bits) );
+                       bits[pass[i][1] >> 3] = 1 << ( pass[i][1] & 7 );
+			       if ( ! connectionok ) break;
                          if (on) {
-				           j = send ( sockdesc, evkeyb,
-					       sizeof(struct hidrep_keyb_t),
-					       MSG_NOSIGNAL );
+			           j = sendreport ( sockdesc, hidrep,
+				       keyreport ( hidrep, mod, bits ) );
                          }
-				         if ( 1 > j )
-				         {
-					       // If sending data fails,
-					       // abort connection
-					       return	-1;
-				         }
+			         if ( 0 > j )
+			         {
+				       // If sending data fails,
+				       // abort connection
+				       return	-1;
+			         }
                       }
-                      pressedkey[0]=0;
-					  break;
-				    }
+				  break;
+			    }
 
                     on = !on;
                     if (stop_writing) {
-                      if (!id){
-                        break;
-                      }
-				    	sprintf ( result, "xinput set-int-prop %d \"Device "\
-				    		"Enabled\" 8 %u", id , !on);
-				    	if ( system ( result ) )
-				    	{
-				        	fprintf ( stderr, "Failed to x11-mute or x11-unmute.\n" );
-					  }
+                      // Input goes either to the device or to the computer
+                      requestgrab ( on );
                     }
-				}
-				break;
-
+			}
+			break;
 
-			  // *** "Modifier" key events
-			  case	KEY_RIGHTMETA:
-				pressedmod = 0x8080;
-                break;
-			  case	KEY_RIGHTCTRL:
-				pressedmod = 0x8010;
-                break;
-			  case	KEY_LEFTMETA:
-				pressedmod = 0x8008;
-                break;
-			  case	KEY_LEFTALT:
-				pressedmod = 0x8004;
-                break;
-			  case	KEY_LEFTCTRL:
-                pressedmod = 0X8001;
-                break;
-			  case	KEY_LEFTSHIFT: //2 
-                pressedmod = 0x0002;
-                break;
-     		  case	KEY_RIGHTALT: //64
-				pressedmod = 0x0040;
-                break;
-			  case	KEY_RIGHTSHIFT: //32
-				pressedmod = 0x0020;
-                break;
-              case	KEY_CAPSLOCK:
-                pressedmod = 0x0100; //57 
-                break;
-              case	KEY_BACKSLASH:
-                pressedmod = 0x0200; //49 #
-                break;
-              case	KEY_102ND:
-                pressedmod = 0x0400; //50 <
-                break;
-
-// *** Regular key events
-			  case	KEY_KPDOT:	++u; // Keypad Dot ~ 99
-			  case	KEY_KP0:	++u; // code 98...
-			  case	KEY_KP9:	++u; // countdown...
-			  case	KEY_KP8:	++u;
-			  case	KEY_KP7:	++u;
-			  case	KEY_KP6:	++u;
-			  case	KEY_KP5:	++u;
-			  case	KEY_KP4:	++u;
-			  case	KEY_KP3:	++u;
-			  case	KEY_KP2:	++u;
-			  case	KEY_KP1:	++u;
-			  case	KEY_KPENTER:	++u;
-			  case	KEY_KPPLUS:	++u;
-			  case	KEY_KPMINUS:	++u;
-			  case	KEY_KPASTERISK:	++u;
-			  case	KEY_KPSLASH:	++u;
-			  case	KEY_NUMLOCK:	++u;
-			  case	KEY_UP:		++u;
-			  case	KEY_DOWN:	++u;
-			  case	KEY_LEFT:	++u;
-			  case	KEY_RIGHT:	++u;
-			  case	KEY_PAGEDOWN:	++u;
-			  case	KEY_END:	++u;
-			  case	KEY_DELETE:	++u;
-			  case	KEY_PAGEUP:	++u;
-			  case	KEY_HOME:	++u;
-			  case	KEY_INSERT:	++u;
-			  case  KEY_PAUSE:  ++u; //[Pause] key
-			  case	KEY_SCROLLLOCK:	++u;
-			  ++u; //[printscr] SYSRQ
-			  case	KEY_F12:	++u; //F12=> code 69
-			  case	KEY_F11:	++u;
-			  case	KEY_F10:	++u;
-			  case	KEY_F9:		++u;
-			  case	KEY_F8:		++u;
-			  case	KEY_F7:		++u;
-			  case	KEY_F6:		++u;
-			  case	KEY_F5:		++u;
-			  case	KEY_F4:		++u;
-			  case	KEY_F3:		++u;
-			  case	KEY_F2:		++u;
-			  case	KEY_F1:		++u;
-			  ++u; // CAPSLOCK
-			  case	KEY_SLASH:	++u;
-			  case	KEY_DOT:	++u;
-			  case	KEY_COMMA:	++u;
-			  case	KEY_GRAVE:	++u;
-			  case	KEY_APOSTROPHE:	++u;
-			  case	KEY_SEMICOLON:	++u;
-			  ++u; //102ND
-			  ++u; //BACKSLASH
-			  case	KEY_RIGHTBRACE:	++u;
-			  case	KEY_LEFTBRACE:	++u;
-			  case	KEY_EQUAL:	++u;
-			  case	KEY_MINUS:	++u;
-			  case	KEY_SPACE:	++u;
-			  case	KEY_TAB:	++u;
-			  case	KEY_BACKSPACE:	++u;
-			  case	KEY_ESC:	++u;
-			  case	KEY_ENTER:	++u; //Return=> code 40
-			  case	KEY_0:		++u;
-			  case	KEY_9:		++u;
-			  case	KEY_8:		++u;
-			  case	KEY_7:		++u;
-			  case	KEY_6:		++u;
-			  case	KEY_5:		++u;
-			  case	KEY_4:		++u;
-			  case	KEY_3:		++u;
-			  case	KEY_2:		++u;
-			  case	KEY_1:		++u;
-			  case	KEY_Z:		++u;
-			  case	KEY_Y:		++u;
-			  case	KEY_X:		++u;
-			  case	KEY_W:		++u;
-			  case	KEY_V:		++u;
-			  case	KEY_U:		++u;
-			  case	KEY_T:		++u;
-			  case	KEY_S:		++u;
-			  case	KEY_R:		++u;
-			  case	KEY_Q:		++u;
-			  case	KEY_P:		++u;
-			  case	KEY_O:		++u;
-			  case	KEY_N:		++u;
-			  case	KEY_M:		++u;
-			  case	KEY_L:		++u;
-			  case	KEY_K:		++u;
-			  case	KEY_J:		++u;
-			  case	KEY_I:		++u;
-			  case	KEY_H:		++u;
-			  case	KEY_G:		++u;
-			  case	KEY_F:		++u;
-			  case	KEY_E:		++u;
-			  case	KEY_D:		++u;
-			  case	KEY_C:		++u;
-			  case	KEY_B:		++u;
-			  case	KEY_A:		u +=3;	// A =>  4
 
-			  default:
-				// Unknown key usage - ignore that
-			  ;
+		  default:
+			// "Modifier" key (see keymodifier), regular key
+			// (see keyusage[] above) or unknown key
+			pressedmod = keymodifier ( inevent->code );
+		  ;
             }
 
                 modifierkeys &= ( 0xffff - pressedmod ); //delete modifier
-				if ( inevent->value >= 1 ) //if value = 1 add it again
-				{
-					modifierkeys |= pressedmod; //add modifier
-				}
+			if ( inevent->value >= 1 ) //if value = 1 add it again
+			{
+				modifierkeys |= pressedmod; //add modifier
+			}
+			maskedmods &= modifierkeys;	// Released now
 
                 //if pressedmod is not an neo-modifier
                 if (pressedmod & 0x8000) {
-                  mod = (char) modifierkeys;
+                  mod = (char) modifierkeys & ~maskedmods;
                 }
 
               
                 //Decide neo-layer by pressed modifiers
-                if(modifierkeys & 0x0022) {
-                  layermod |= 0x01;
-                }
-                if(modifierkeys & 0x0300) {
-                  layermod |= 0x02;
-                }
-                if(modifierkeys & 0x0440) {
-                  layermod |= 0x04;
-                }
-
-                if((layermod & 0x01) == 0x01) {
-                  layer = 1;
-                }
-                if((layermod & 0x02) == 0x02) {
-                  layer = 2;
-                }
-                if((layermod & 0x04) == 0x04) {
-                  layer = 3;
-                }
-                if((layermod & 0x03) == 0x03) {
-                  layer = 4;
-                }
-                if((layermod & 0x06) == 0x06) {
-                  layer = 5;
-                }
-
-
-                //get char for the pressed character and layer
-                printchar = chars[u][layer][1];
-
-                if(printchar) {
-                  //get mod for the pressed charcter and layer
-                  mod = chars[u][layer][0];
-                  layer = 0;
-                }
-				
-				if ( inevent->value == 1 )
-				{
-					// "Key down": Add to list of
-					// currently pressed keys
-					for ( j = 0; j < 8; ++j )
-					{
-					    if (pressedkey[j] == 0)
-					    {
-						pressedkey[j]=printchar;
-						j = 8;
-					    }
-					    else if(pressedkey[j] == printchar)
-					    {
-						j = 8;
-					    }
-					}
-				}
-				else if ( inevent->value == 0 )
-				{	// KEY UP: Remove from array
-					for ( j = 0; j < 8; ++j )
-					{
-					    if ( pressedkey[j] == printchar )
-					    {
-						while ( j < 7 )
-						{
-						    pressedkey[j] =
-							pressedkey[j+1];
-						    ++j;
-						}
-					    pressedkey[7] = 0;
-					    }
-					}
-				} 
-				else	// "Key repeat" event
-				{
-					; // This should be handled
-					// by the remote side, not us.
-				}
+                layer = neolayer ( modifierkeys );
 
+                //get char and mod for the pressed character and layer
+                printchar = lookupkey ( u, layer, &mod );
+			
+			if ( printchar == 0 )
+			{
+				; // No key on this layer
+			}
+			else if ( inevent->value == 1 )
+			{
+				// "Key down": Add to set of
+				// currently pressed keys
+				pressedbits[printchar >> 3] |=
+					1 << ( printchar & 7 );
+			}
+			else if ( inevent->value == 0 )
+			{	// KEY UP: Remove from set
+				pressedbits[printchar >> 3] &=
+					~( 1 << ( printchar & 7 ) );
+			}
+			else	// "Key repeat" event
+			{
+				; // This should be handled
+				// by the remote side, not us.
+			}
 
-                evkeyb->btcode = 0xA1;
-				evkeyb->rep_id = REPORTID_KEYBD;
-				memcpy ( evkeyb->key, pressedkey, 8 );
-				evkeyb->modify = mod;
-                //printf("\nsend mod: 0x%08x, pressedkey: %u,%u,%u,%u,%u,%u,%u,%u",mod,pressedkey[0],pressedkey[1],pressedkey[2],pressedkey[3],pressedkey[4],pressedkey[5],pressedkey[6],pressedkey[7]);
-				if ( ! connectionok ) break;
+			if ( ! connectionok ) break;
                 if (on) {
-				j = send ( sockdesc, evkeyb,
-					sizeof(struct hidrep_keyb_t),
-					MSG_NOSIGNAL );
+			j = sendreport ( sockdesc, hidrep,
+				keyreport ( hidrep, mod, pressedbits ) );
                 }
-				if ( 1 > j )
-				{
-					// If sending data fails,
-					// abort connection
-					return	-1;
-				}
-
-			break;
-		  // *** Mouse movement events
-		  case	EV_REL:
-			switch ( inevent->code )
+			if ( 0 > j )
 			{
-			  case	ABS_X:
-			  case	ABS_Y:
-			  case	ABS_Z:
-			  case	REL_WHEEL:
-				evmouse->btcode = 0xA1;
-				evmouse->rep_id = REPORTID_MOUSE;
-				evmouse->button = mousebuttons & 0x07;
-				evmouse->axis_x =
-					( inevent->code == ABS_X ?
-					  inevent->value : 0 );
-				evmouse->axis_y =
-					( inevent->code == ABS_Y ?
-					  inevent->value : 0 );
-				evmouse->axis_z =
-					( inevent->code >= ABS_Z ?
-					  inevent->value : 0 );
-				if ( ! connectionok ) break;
-				j = send ( sockdesc, evmouse,
-					sizeof(struct hidrep_mouse_t),
-					MSG_NOSIGNAL );
-				if ( 1 > j )
-				{
-					return	-1;
-				}
-				break;
+				// If sending data fails,
+				// abort connection
+				return	-1;
 			}
+
+		break;
+	  // *** Mouse movement events
+	  case	EV_REL:
+		switch ( inevent->code )
+		{
+		  // Collected until the end of the frame (SYN_REPORT)
+		  case	ABS_X:
+			mousedx += inevent->value;
+			mousedirty = 1;
 			break;
-		  // *** Various events we do not know. Ignore those.
-		  case	EV_ABS:
-		  case	EV_MSC:
-		  case	EV_LED:
-		  case	EV_SND:
-		  case	EV_REP:
-		  case	EV_FF:
-		  case	EV_PWR:
-		  case	EV_FF_STATUS:
+		  case	ABS_Y:
+			mousedy += inevent->value;
+			mousedirty = 1;
+			break;
+		  case	ABS_Z:
+		  case	REL_WHEEL:
+			mousedz += inevent->value;
+			mousedirty = 1;
 			break;
 		}
-
+		break;
+	  // *** Various events we do not know. Ignore those.
+	  case	EV_ABS:
+	  case	EV_MSC:
+	  case	EV_LED:
+	  case	EV_SND:
+	  case	EV_REP:
+	  case	EV_FF:
+	  case	EV_PWR:
+	  case	EV_FF_STATUS:
+		break;
 	}
 	return	0;
 }
 
 int	main ( int argc, char ** argv )
 {
-	int			i,  j;
+	int			i,  j,  n;
 	int			sockint, sockctl; // For the listening sockets
-	struct sockaddr_l2	l2a;
-	socklen_t		alen=sizeof(l2a);
-	int			sint,  sctl;	  // For the one-session-only
-						  // socket descriptor handles
-	char			badr[40];
-	fd_set			fds;		  // fds for listening sockets
-	fd_set			efds;	          // dev-event file descriptors
-	int			maxevdevfileno;
+	int			sint;		  // Interrupt channel of the
+						  // host with the focus
+	char			badr[40];	  // Description of the host
+	char			buf[64];	  // Output report from the host
+	struct epoll_event	evs[EVLOOPMAX];	  // Ready descriptors
+	int			k, fd;
+	sigset_t		sigs, oldsigs;
 	char			skipsdp = 0;	  // On request, disable SDPreg
-	struct timeval		tv;		  // Used for "select"
 	int			onlyoneevdev = -1;// If restricted to using only one evdev
-	int			mutex11 = 0;      // try to "mute" in x11?
 	char			*fifoname = NULL; // Filename for fifo, if applicable
+	char			*layoutname = NULL; // Layout file, if applicable
+	char			*statsname = NULL; // Statistics socket (-S)
+	char			*recname = NULL;  // Record input to file (-R)
+	char			*replayname = NULL; // Replay recording (-P)
+	char			*outname = NULL;  // Output of the replay (-O)
+	char			fastreplay = 0;	  // Replay at full speed (-F)
+	char			usepipe = 0;	  // Pipelined threads (-p)
+	char			listdevs = 0;	  // Only list the devices (-l)
 	// Parse command line
 	for ( i = 1; i < argc; ++i )
 	{
@@ -1366,9 +4488,23 @@ int	main ( int argc, char ** argv )
 		else if ( 0 == strncmp ( argv[i], "-e", 2 ) ) {
 			onlyoneevdev = atoi(argv[i]+2);
 		}
+		else if ( ( 0 == strncmp ( argv[i], "-a", 2 ) ) ||
+			  ( 0 == strncmp ( argv[i], "-r", 2 ) ) )
+		{
+			if ( 0 > adddevrule ( argv[i][1] == 'a', argv[i] + 2 ) )
+				return	1;
+		}
 		else if ( 0 == strcmp ( argv[i], "-l" ) )
+		{	// After all rules are known
+			listdevs = 1;
+		}
+		else if ( 0 == strcmp ( argv[i], "-n" ) )
 		{
-			return list_input_devices();
+			nkro = 1;
+		}
+		else if ( 0 == strcmp ( argv[i], "-t" ) )
+		{
+			timing = 1;
 		}
 		else if ( 0 == strcmp ( argv[i], "-d" ) )
 		{
@@ -1376,26 +4512,77 @@ int	main ( int argc, char ** argv )
 		}
 		else if ( 0 == strcmp ( argv[i], "-x" ) )
 		{
-			mutex11 = 1;
             stop_writing = 1;
-
-            if ( NULL == ( result = malloc ( 512 ) ) )
-		    {
-			   printf ( "Memory alloc error\n" );
-			   return 1;
-		    }
-
 		}
 		else if ( 0 == strncmp ( argv[i], "-f", 2 ) )
 		{
 			fifoname = argv[i] + 2;
 		}
+		else if ( 0 == strncmp ( argv[i], "-k", 2 ) )
+		{
+			layoutname = argv[i] + 2;
+		}
+		else if ( 0 == strncmp ( argv[i], "-u", 2 ) )
+		{	// Local host only: nothing to announce by SDP
+			transport = &unixtransport;
+			transaddr = argv[i] + 2;
+			skipsdp = 1;
+		}
+		else if ( 0 == strncmp ( argv[i], "-b", 2 ) )
+		{
+			if ( 0 > loadbonded ( argv[i] + 2 ) )
+				return	1;
+		}
+		else if ( 0 == strncmp ( argv[i], "-S", 2 ) )
+		{
+			statsname = argv[i] + 2;
+		}
+		else if ( 0 == strncmp ( argv[i], "-R", 2 ) )
+		{
+			recname = argv[i] + 2;
+		}
+		else if ( 0 == strncmp ( argv[i], "-P", 2 ) )
+		{
+			replayname = argv[i] + 2;
+		}
+		else if ( 0 == strncmp ( argv[i], "-O", 2 ) )
+		{
+			outname = argv[i] + 2;
+		}
+		else if ( 0 == strcmp ( argv[i], "-F" ) )
+		{
+			fastreplay = 1;
+		}
+		else if ( 0 == strncmp ( argv[i], "-p", 2 ) )
+		{
+			if ( 0 > parsecpus ( argv[i] + 2 ) )
+				return	1;
+			usepipe = 1;
+		}
 		else
 		{
 			fprintf ( stderr, "Invalid argument: \'%s\'\n", argv[i]);
 			return	1;
 		}
 	}
+	if ( listdevs )
+	{
+		return	list_input_devices();
+	}
+	if ( ( NULL != layoutname ) && ( 1 > loadlayout ( layoutname ) ) )
+	{
+		return	1;
+	}
+	if ( NULL != replayname )
+	{	// No devices, no Bluetooth
+		i = replay ( replayname, outname, fastreplay );
+		if ( timing ) latprint ();
+		return	i;
+	}
+	if ( ( NULL != recname ) && ( 0 > initrecord ( recname ) ) )
+	{
+		return	1;
+	}
 	if ( ! skipsdp )
 	{
 		if ( dosdpregistration() )
@@ -1406,41 +4593,70 @@ int	main ( int argc, char ** argv )
 	}
 	if ( NULL == fifoname )
 	{
-		if ( 1 > initevents (onlyoneevdev, mutex11) )
-		{
-			fprintf ( stderr, "Failed to open event interface files\n" );
-			return	2;
+		if ( 1 > initevents (onlyoneevdev) )
+		{	// Not fatal, devices may be plugged in later
+			fprintf ( stderr, "No event interface files yet, "
+					"waiting for devices\n" );
 		}
 	} else {
+		stop_writing = 0;	// Nothing to grab
 		if ( 1 > initfifo ( fifoname ) )
 		{
 			fprintf ( stderr, "Failed to create/open fifo [%s]\n", fifoname );
 			return	2;
 		}
 	}
-	maxevdevfileno = add_filedescriptors ( &efds );
-	if ( maxevdevfileno <= 0 )
+	if ( 0 > ( evloopfd = epoll_create1 ( EPOLL_CLOEXEC ) ) )
 	{
-		fprintf ( stderr, "Failed to organize event input.\n" );
+		fprintf ( stderr, "Failed to create event loop: %s\n",
+				strerror ( errno ) );
 		return	13;
 	}
-	sockint = socket ( AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP );
-	sockctl = socket ( AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP );
-	if ( ( 0 > sockint ) || ( 0 > sockctl ) )
+	for ( i = 0; i < evdevslen; ++i )
+	{
+		if ( ! evdevs[i].used ) continue;
+		if ( 0 > evloop_add ( i, EVL_EVDEV ) )
+		{
+			fprintf ( stderr, "Failed to organize event input.\n" );
+			return	13;
+		}
+	}
+	if ( NULL == fifoname )
+	{	// Pick up devices plugged in (or out) while running
+		if ( ( 0 > ( fd = watchevents () ) ) ||
+		     ( 0 > evloop_add ( fd, EVL_HOTPLUG ) ) )
+		{
+			fprintf ( stderr, "Failed to organize event input.\n" );
+			return	13;
+		}
+	}
+	if ( NULL != layoutname )
+	{	// Not fatal: the layout just cannot be reloaded then
+		if ( 0 <= ( fd = watchlayout ( layoutname ) ) )
+		{
+			evloop_add ( fd, EVL_LAYOUT );
+		}
+	}
+	statstart = time ( NULL );
+	if ( ( NULL != statsname ) &&
+	     ( ( 0 > ( fd = initstats ( statsname ) ) ) ||
+	       ( 0 > evloop_add ( fd, EVL_STATS ) ) ) )
 	{
-		fprintf ( stderr, "Failed to generate bluetooth sockets\n" );
-		return	2;
+		return	13;
 	}
-	if ( btbind ( sockint, PSMHIDINT ) || btbind ( sockctl, PSMHIDCTL ))
+	sockctl = transport->listen ( transaddr, PSMHIDCTL );
+	sockint = transport->listen ( transaddr, PSMHIDINT );
+	if ( ( 0 > sockint ) || ( 0 > sockctl ) )
 	{
-		fprintf ( stderr, "Failed to bind sockets (%d/%d) "
-				"to PSM (%d/%d)\n",
-				sockctl, sockint, PSMHIDCTL, PSMHIDINT );
+		fprintf ( stderr, "Failed to listen on int/ctl %s socket\n",
+				transport->name );
+		if ( sockint >= 0 ) close ( sockint );
+		if ( sockctl >= 0 ) close ( sockctl );
 		return	3;
 	}
-	if ( listen ( sockint, 1 ) || listen ( sockctl, 1 ) )
+	if ( evloop_add ( sockctl, EVL_LISTENCTL ) ||
+	     evloop_add ( sockint, EVL_LISTENINT ) )
 	{
-		fprintf ( stderr, "Failed to listen on int/ctl BT socket\n" );
 		close ( sockint );
 		close ( sockctl );
 		return	4;
@@ -1448,171 +4664,206 @@ int	main ( int argc, char ** argv )
 	// Add handlers to catch signals:
 	// All do the same, terminate the program safely
 	// Ctrl+C will be ignored though (SIGINT) while a connection is active
+	// The signals stay blocked except while waiting in epoll_pwait, so
+	// a shutdown request can never slip in between check and sleep.
 	signal ( SIGHUP,  &onsignal );
 	signal ( SIGTERM, &onsignal );
 	signal ( SIGINT,  &onsignal );
+	signal ( SIGUSR1, &onsignal );	// Print latency histogram (-t)
+	sigemptyset ( &sigs );
+	sigaddset ( &sigs, SIGHUP );
+	sigaddset ( &sigs, SIGTERM );
+	sigaddset ( &sigs, SIGINT );
+	sigaddset ( &sigs, SIGUSR1 );
+	if ( timing )
+	{	// Also on LCtrl+PRINT, which exits right away
+		atexit ( latprint );
+	}
+	sigprocmask ( SIG_BLOCK, &sigs, &oldsigs );
+	// Started now, so the threads never take the signals above
+	if ( usepipe && ( 0 > pipestart () ) )
+	{
+		return	13;
+	}
 	fprintf ( stdout, "The HID-Client is now ready to accept connections "
 			"from another machine\n" );
 	//i = system ( "stty -echo" );	// Disable key echo to the console
+	for ( i = 0; i < MAXHOSTS; ++i )
+	{
+		sessions[i].sctl = sessions[i].sint = -1;
+	}
+	if ( nbonded > 0 )
+	{	// Known hosts (-b): dial the last one
+		snprintf ( dialpeer, sizeof(dialpeer), "%s", bonded[0] );
+		dialbackoff = DIALMIN;
+		dialat = nowstamp ();
+	}
 	while ( 0 == prepareshutdown )
-	{	// Wait for any shutdown-event to occur
-		sint = sctl = 0;
-		add_filedescriptors ( &efds );
-		tv.tv_sec  = 0;
-		tv.tv_usec = 0;
-		while ( 0 < (j = select(maxevdevfileno+1,&efds,NULL,NULL,&tv)))
-		{	// Collect and discard input data as long as available
-			if ( -1 >  ( j = parse_events ( &efds, 0 ) ) )
-			{	// LCtrl-LAlt-PAUSE - terminate program
-				prepareshutdown = 1;
-				break;
-			}
-			add_filedescriptors ( &efds );
-			tv.tv_sec  = 0;
-			tv.tv_usec = 500; // minimal delay
+	{	// Sleep until any descriptor becomes ready or a signal arrives.
+		// Only a half-open connection (control channel accepted, no
+		// interrupt channel yet) and dialing back a host (-b) need a
+		// timeout.
+		i = halfopen ();
+		n = dialwait ();
+		j = epoll_pwait ( evloopfd, evs, EVLOOPMAX,
+			( ( i < 0 ) || ( ( n >= 0 ) && ( n < i ) ) ) ? n : i,
+			&oldsigs );
+		if ( dumplatency )
+		{
+			dumplatency = 0;
+			if ( timing ) latprint ();
 		}
-		if ( prepareshutdown )
-			break;
-		connectionok = 0;
-		tv.tv_sec  = 1;
-		tv.tv_usec = 0;
-		FD_ZERO ( &fds );
-		FD_SET  ( sockctl, &fds );
-		j = select ( sockctl + 1, &fds, NULL, NULL, &tv );
 		if ( j < 0 )
 		{
 			if ( errno == EINTR )
 			{	// Ctrl+C ? - handle that elsewhere
 				continue;
 			}
-			fprintf ( stderr, "select() error on BT socket: %s! "
+			fprintf ( stderr, "epoll_wait() error: %s! "
 					"Aborting.\n", strerror ( errno ) );
 			return	11;
 		}
-		if ( j == 0 )
-		{	// Nothing happened, check for shutdown req and retry
-			if ( debugevents & 0x2 )
-				fprintf ( stdout, "," );
-			continue;
-		}
-		sctl = accept ( sockctl, (struct sockaddr *)&l2a, &alen );
-		if ( sctl < 0 )
-		{
-			if ( errno == EAGAIN )
-			{
-				continue;
-			}
-			fprintf ( stderr, "Failed to get a control connection:"
-					" %s\n", strerror ( errno ) );
-			continue;
-		}
-		tv.tv_sec  = 3;
-		tv.tv_usec = 0;
-		FD_ZERO ( &fds );
-		FD_SET  ( sockint, &fds );
-		j = select ( sockint + 1, &fds, NULL, NULL, &tv );
-		if ( j < 0 )
-		{
-			if ( errno == EINTR )
-			{	// Might have been Ctrl+C
-				close ( sctl );
-				continue;
-			}
-			fprintf ( stderr, "select() error on BT socket: %s! "
-					"Aborting.\n", strerror ( errno ) );
-			return	12;
-		}
-		if ( j == 0 )
-		{
-			fprintf ( stderr, "Interrupt connection failed to "
-					"establish (control connection already"
-					" there), timeout!\n" );
-			close ( sctl );
-			continue;
-		}
-		sint = accept ( sockint, (struct sockaddr *)&l2a, &alen );
-		if ( sint < 0 )
+		for ( k = 0; k < j; ++k )
 		{
-			close ( sctl );
-			if ( errno == EAGAIN )
-				continue;
-			fprintf ( stderr, "Failed to get an interrupt "
-					"connection: %s\n", strerror(errno));
-			continue;
-		}
-		ba2str ( &l2a.l2_bdaddr, badr );
-		badr[39] = 0;
-		fprintf ( stdout, "Incoming connection from node [%s] "
-				"accepted and established.\n", badr );
-		tv.tv_sec  = 0;
-		tv.tv_usec = 0;
-		j = -1;
-		add_filedescriptors ( &efds );
-		while ( 0 < (j = select(maxevdevfileno+1,&efds,NULL,NULL,&tv)))
-		{
-			// This loop removes all input garbage that might be
-			// already in the queue
-			if ( -1 > ( j = parse_events ( &efds, 0 ) ) )
-			{	// LCtrl-LAlt-PAUSE - terminate program
-				prepareshutdown = 1;
-				break;
-			}
-			add_filedescriptors ( &efds );
-			tv.tv_sec  = 0;
-			tv.tv_usec = 0;
-		}
-		if ( prepareshutdown )
-			break;
-		connectionok = 1;
-		memset ( pressedkey, 0, 8 );
-		modifierkeys = 0;
-		mousebuttons = 0;
-		while ( connectionok )
-		{
-			add_filedescriptors ( &efds );
-			tv.tv_sec  = 1;
-			tv.tv_usec = 0;
-			while ( 0 < ( j = select ( maxevdevfileno + 1, &efds,
-							NULL, NULL, &tv ) ) )
+			sint = ( focus >= 0 ) ? sessions[focus].sint : -1;
+			fd = EVL_FD ( evs[k].data.u64 );
+			switch ( EVL_KIND ( evs[k].data.u64 ) )
 			{
-				if ( 0 > ( j = parse_events ( &efds, sint ) ) )
-				{
-					// PAUSE pressed - close connection
+			  case	EVL_EVDEV:
+				if ( evs[k].events & ( EPOLLERR | EPOLLHUP ) )
+				{	// Unplugged
+					closeevdev ( fd );
+					break;
+				}
+				if ( 0 > parse_events ( fd, sint ) )
+				{	// Sending failed - close connection
 					connectionok = 0;
-					if ( j < -1 )
-					{	// LCtrl-LAlt-PAUSE - terminate
-						close ( sint );
-						close ( sctl );
-						prepareshutdown = 1;
+				}
+				break;
+			  case	EVL_LISTENCTL:
+				fd = acceptchannel ( sockctl, "a control",
+						badr, sizeof(badr) );
+				if ( ( fd >= 0 ) && ( 0 > sessionopen ( fd, badr ) ) )
+					close ( fd );
+				break;
+			  case	EVL_LISTENINT:
+				if ( ( 0 > sessionpair ( "" ) ) && ( 0 <= ( fd =
+					acceptchannel ( sockctl, "a control",
+						badr, sizeof(badr) ) ) ) &&
+				     ( 0 > sessionopen ( fd, badr ) ) )
+				{	// Both became ready in this wakeup, the
+					// control channel has to come first
+					close ( fd );
+				}
+				fd = acceptchannel ( sockint, "an interrupt",
+						badr, sizeof(badr) );
+				if ( fd < 0 )
+					break;
+				if ( 0 > ( n = sessionpair ( badr ) ) )
+				{	// No control channel yet
+					close ( fd );
+					break;
+				}
+				fprintf ( stdout, "Incoming connection from %s "
+						"accepted and established.\n", badr );
+				sessionestablish ( n, fd );
+				break;
+			  case	EVL_LAYOUT:
+				reloadlayout ( fd, layoutname, sint );
+				break;
+			  case	EVL_HOTPLUG:
+				hotplug ( fd );
+				break;
+			  case	EVL_STATS:
+				servestats ( fd );
+				break;
+			  case	EVL_PIPE:
+				piperequests ( fd );
+				break;
+			  case	EVL_DIAL:
+				dialready ( fd );
+				break;
+			  case	EVL_CTL:
+				if ( ( 0 > ( n = sessionfind ( fd ) ) ) ||
+				     ( fd != sessions[n].sctl ) )
+					break;	// Already closed
+				if ( ! ( evs[k].events &
+					( EPOLLIN | EPOLLERR | EPOLLHUP ) ) )
+					break;
+				if ( 0 > handlecontrol ( &sessions[n] ) )
+					sessionclose ( n );
+				break;
+			  case	EVL_INT:
+				if ( ( 0 > ( n = sessionfind ( fd ) ) ) ||
+				     ( fd != sessions[n].sint ) )
+					break;	// Already closed
+				if ( evs[k].events & EPOLLOUT )
+				{	// Congestion is over
+					if ( 0 > ( ( n == focus ) ?
+						flushreports ( fd ) :
+						sendrelease ( n ) ) )
+					{
+						sessions[n].linklost = 1;
+						sessionclose ( n );
+						break;
 					}
+				}
+				if ( ! ( evs[k].events &
+					( EPOLLIN | EPOLLERR | EPOLLHUP ) ) )
 					break;
+				// Output reports (LEDs) from the host, and
+				// a closed channel ends the connection
+				i = recv ( fd, buf, sizeof(buf), MSG_DONTWAIT );
+				if ( ( i > 1 ) && ( (unsigned char)buf[0] ==
+					( HIDP_DATA | HIDP_REPTYPE_OUTPUT ) ) )
+				{
+					outputreport ( &sessions[n],
+						(unsigned char *)buf + 1, i - 1 );
+				}
+				if ( ( i == 0 ) ||
+				     ( ( i < 0 ) && ( errno != EAGAIN ) &&
+				       ( errno != EINTR ) ) )
+				{
+					sessions[n].linklost = ( i < 0 ) &&
+							LINKLOST ( errno );
+					sessionclose ( n );
 				}
-				add_filedescriptors ( &efds );
-				tv.tv_sec  = 1;
-				tv.tv_usec = 0;
+				break;
+			}
+			if ( ( focus >= 0 ) && ( ! connectionok ) )
+			{	// Sending to the focused host failed
+				sessions[focus].linklost = 1;
+				sessionclose ( focus );
 			}
 		}
-		connectionok = 0;
-		close ( sint );
-		close ( sctl );
-		sint = sctl =  0;
-		fprintf ( stderr, "Connection closed\n" );
-		usleep ( 500000 ); // Sleep 0.5 secs between connections
-				   // to not be flooded
+		if ( __atomic_exchange_n ( &focusrequest, 0, __ATOMIC_ACQ_REL ) )
+		{	// LAlt+PRINT
+			if ( 0 > ( i = sessionnext ( focus ) ) )
+				fprintf ( stdout, "No other host connected\n" );
+			else
+				switchfocus ( i, 0 );
+		}
 	}
 	//i = system ( "stty echo" );	   // Set console back to normal
+	pipestop ();	// Sends what is left in the pipeline
+	for ( n = 0; n < MAXHOSTS; ++n )
+	{
+		if ( sessions[n].sint >= 0 ) close ( sessions[n].sint );
+		if ( sessions[n].sctl >= 0 ) close ( sessions[n].sctl );
+	}
+	if ( dialfd >= 0 ) close ( dialfd );
 	close ( sockint );
 	close ( sockctl );
+	transport->cleanup ( transaddr, PSMHIDCTL );
+	transport->cleanup ( transaddr, PSMHIDINT );
+	close ( evloopfd );
 	if ( ! skipsdp )
 	{
 		sdpunregister ( sdphandle ); // Remove HID info from SDP server
 	}
-	if ( NULL == fifoname )
-	{
-		closeevents ();
-	} else {
-		closefifo ();
-	}
+	closeevents ();
+	if ( NULL != recfile ) fclose ( recfile );
+	if ( NULL != statsname ) unlink ( statsname );
 	cleanup_stdin ();	   // And remove the input queue from stdin
 	fprintf ( stderr, "Stopped hidclient.\n" );
 	return	0;
@@ -1628,9 +4879,31 @@ void	showhelp ( void )
 "The following command-line parameters can be used:\n" \
 "-h|-?		Show this information\n" \
 "-e<num>\t	Use only the one event device numbered <num>\n" \
+"-a<rule>	Use only keyboards and mice matching one of the -a rules\n" \
+"-r<rule>	Do not use keyboards and mice matching the rule\n" \
+"		<rule> is vendor:product (hex, product may be *) or part\n" \
+"		of the device name; -l shows which devices are used\n" \
 "-f<name>	Use fifo <name> instead of event input devices\n" \
+"-k<name>	Use layout file <name> (built by mklayout) instead of the\n" \
+"		built-in Neo layout; reloaded whenever it is rebuilt\n" \
 "-l		List available input devices\n" \
-"-x		Disable device in X11 while hidclient is running\n" \
+"-n		N-key-rollover: report any number of keys pressed at once\n" \
+"		instead of at most 8\n" \
+"-u<path>	Listen on Unix sockets <path>.ctl/.int instead of Bluetooth\n" \
+"		(no SDP), e.g. for the test host hidhost\n" \
+"-b<name>	Keep the hosts that connected in file <name>; dial the last\n" \
+"		one back at start and whenever its link is lost\n" \
+"-S<path>	Serve statistics (key=value lines) on Unix socket <path>\n" \
+"-R<name>	Record all input events to file <name>\n" \
+"-P<name>	Replay recording <name> (no Bluetooth), writing the reports\n" \
+"		as hex lines to stdout or the file given with -O<name>;\n" \
+"		-F replays as fast as possible\n" \
+"-p[r,t,x]	Pipelined: read, translate and send in three threads,\n" \
+"		optionally pinned to CPUs <r>, <t> and <x>\n" \
+"-t		Measure latency from input event to sent report; the\n" \
+"		percentiles are printed on SIGUSR1 and at exit\n" \
+"-x		Hide input from the local machine while it goes to the\n" \
+"		remote side (PRINT toggles)\n" \
 "-s|--skipsdp	Skip SDP registration\n" \
 "		Do not register with the Service Discovery Infrastructure\n" \
 "		(for debug purposes)\n\n" \
@@ -1641,10 +4914,12 @@ void	showhelp ( void )
 "following command line:\n" \
 "		openvt -s -w hidclient\n" \
 "This will even return to your xsession after hidclient terminates.\n\n" \
+"Up to %d hosts can be connected at the same time; the input goes to one\n" \
+"of them, LeftAlt+PRINT moves it on to the next.\n" \
 "hidclient connections can be dropped at any time by pressing the PAUSE\n" \
 "key; the program will wait for other connections afterward.\n" \
-"To stop hidclient, press LeftCtrl+LeftAlt+Pause.\n"
-		);
+"To stop hidclient, press LeftCtrl+LeftAlt+Pause.\n",
+		MAXHOSTS );
 	return;
 }
 
@@ -1653,6 +4928,10 @@ void	onsignal ( int i )
 	// Shutdown should be done if:
 	switch ( i )
 	{
+	  case	SIGUSR1:
+		// Not a shutdown: print the latency histogram
+		dumplatency = 1;
+		break;
 	  case	SIGINT:
 		if ( 0 == connectionok )
 		{
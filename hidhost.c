@@ -0,0 +1,323 @@
+/*
+ * hidhost - Stand-in HID host, to run hidclient without a Bluetooth adapter
+ *
+ *	Connects to the control and interrupt channels that hidclient offers
+ *	with -u<path> (Unix domain SOCK_SEQPACKET sockets <path>.ctl and
+ *	<path>.int, in that order, like a host connects the L2CAP PSMs) and
+ *	receives its reports.
+ *
+ * Usage:	hidhost <path> [-l] [-f<fifo> [-n<count>] [-w<window>]]
+ *		Without -f, every report is printed as hex, with its arrival
+ *		time, until hidclient closes the connection.
+ *		-f<fifo> drives hidclient, started with -f<fifo> as well:
+ *		   hidhost writes key events (KEY_A pressed and released in
+ *		   turn) to the fifo, each of which makes hidclient send one
+ *		   keyboard report, and measures the time from writing an
+ *		   event to receiving its report. At the end, throughput and
+ *		   p50/p99/p99.9/max latency are printed.
+ *		-n<count> is the number of key events (default 10000)
+ *		-w<window> is the number of events written ahead of the
+ *		   reports received (default 1: strictly one at a time)
+ *		If hidclient does not send yet, it is switched to the
+ *		remote side with PRINT first.
+ *		-l listens on <path>.ctl and <path>.int instead, for
+ *		   hidclient to connect to, like a host it dials back
+ *		   (hidclient -u<own path> -b<file>, with <path> in <file>).
+ *		   After each connection the next one is awaited.
+ *
+ * License:	GPL v2, see hidclient.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/input.h>
+
+#define	REPORTID_KEYBD	2
+// Wait at most this long for a report (milliseconds)
+#define	REPTIMEOUT	1000
+
+int		hostconnect(const char *,const char *);
+int		hostlisten(const char *,const char *);
+int		hostaccept(int,const char *);
+uint64_t	nowstamp(void);
+int		sendkey(int,int,int);
+int		recvkeyb(int,int);
+int		cmpstamp(const void *,const void *);
+int		printreports(int);
+int		drive(int,int,int,int);
+
+// Connect to socket path.suffix, returns the socket or <0
+int	hostconnect ( const char *path, const char *suffix )
+{
+	struct sockaddr_un	sun;
+	int	fd;
+	memset ( &sun, 0, sizeof(sun) );
+	sun.sun_family = AF_UNIX;
+	snprintf ( sun.sun_path, sizeof(sun.sun_path), "%s.%s", path, suffix );
+	if ( ( 0 > ( fd = socket ( AF_UNIX, SOCK_SEQPACKET, 0 ) ) ) ||
+	     ( 0 > connect ( fd, (struct sockaddr *)&sun, sizeof(sun) ) ) )
+	{
+		fprintf ( stderr, "Failed to connect to [%s]: %s\n",
+				sun.sun_path, strerror ( errno ) );
+		if ( fd >= 0 ) close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+// Listen on socket path.suffix (-l), returns the socket or <0
+int	hostlisten ( const char *path, const char *suffix )
+{
+	struct sockaddr_un	sun;
+	int	fd;
+	memset ( &sun, 0, sizeof(sun) );
+	sun.sun_family = AF_UNIX;
+	snprintf ( sun.sun_path, sizeof(sun.sun_path), "%s.%s", path, suffix );
+	unlink ( sun.sun_path );
+	if ( ( 0 > ( fd = socket ( AF_UNIX, SOCK_SEQPACKET, 0 ) ) ) ||
+	     ( 0 > bind ( fd, (struct sockaddr *)&sun, sizeof(sun) ) ) ||
+	     ( 0 > listen ( fd, 1 ) ) )
+	{
+		fprintf ( stderr, "Failed to listen on [%s]: %s\n",
+				sun.sun_path, strerror ( errno ) );
+		if ( fd >= 0 ) close ( fd );
+		return	-1;
+	}
+	return	fd;
+}
+
+// Accept the channel named what on listening socket fd, returns it or <0
+int	hostaccept ( int fd, const char *what )
+{
+	int	s;
+	if ( 0 > ( s = accept ( fd, NULL, NULL ) ) )
+	{
+		fprintf ( stderr, "Failed to accept the %s channel: %s\n",
+				what, strerror ( errno ) );
+		return	-1;
+	}
+	return	s;
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds, as in hidclient
+uint64_t	nowstamp ( void )
+{
+	struct timespec	ts;
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return	ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *	sendkey (fifo, code, value) - write key event code/value and the
+ *	SYN_REPORT ending its frame to hidclient's fifo, in one write so
+ *	hidclient never sees half a frame. Returns <0 on error
+ */
+int	sendkey ( int fifo, int code, int value )
+{
+	struct input_event	ev[2];
+	uint64_t	now = nowstamp ();
+	memset ( ev, 0, sizeof(ev) );
+	ev[0].input_event_sec = ev[1].input_event_sec = now / 1000000000ULL;
+	ev[0].input_event_usec = ev[1].input_event_usec =
+			now % 1000000000ULL / 1000;
+	ev[0].type = EV_KEY;
+	ev[0].code = code;
+	ev[0].value = value;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
+	if ( sizeof(ev) != write ( fifo, ev, sizeof(ev) ) )
+	{
+		fprintf ( stderr, "Failed to write to fifo: %s\n",
+				strerror ( errno ) );
+		return	-1;
+	}
+	return	0;
+}
+
+/*
+ *	recvkeyb (sint, timeout) - wait up to timeout ms for the next
+ *	keyboard report on the interrupt channel, skipping others.
+ *	Returns 1 if one arrived, 0 on timeout, <0 if the channel closed
+ */
+int	recvkeyb ( int sint, int timeout )
+{
+	struct pollfd	pfd = { sint, POLLIN, 0 };
+	unsigned char	buf[64];
+	int	j;
+	while ( 1 )
+	{
+		if ( 0 >= ( j = poll ( &pfd, 1, timeout ) ) )
+			return	j < 0 ? -1 : 0;
+		if ( 0 >= ( j = recv ( sint, buf, sizeof(buf), 0 ) ) )
+			return	-1;
+		if ( ( j >= 2 ) && ( buf[1] == REPORTID_KEYBD ) )
+			return	1;
+	}
+}
+
+int	cmpstamp ( const void *a, const void *b )
+{
+	uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return	( x > y ) - ( x < y );
+}
+
+// Print each report arriving on sint, until the connection closes
+int	printreports ( int sint )
+{
+	unsigned char	buf[64];
+	uint64_t	start = nowstamp ();
+	int	i, j;
+	while ( 0 < ( j = recv ( sint, buf, sizeof(buf), 0 ) ) )
+	{
+		printf ( "%10.6f", ( nowstamp () - start ) / 1e9 );
+		for ( i = 0; i < j; ++i ) printf ( " %02x", buf[i] );
+		printf ( "\n" );
+		fflush ( stdout );
+	}
+	return	0;
+}
+
+/*
+ *	drive (sint, fifo, count, window) - write count key events to fifo,
+ *	at most window ahead of the reports received on sint, and print
+ *	the latency of each event to its report. Returns 0 on success
+ */
+int	drive ( int sint, int fifo, int count, int window )
+{
+	uint64_t	*sent, *lat, start;
+	int	i, j, k;
+	if ( ( NULL == ( sent = calloc ( count, sizeof(*sent) ) ) ) ||
+	     ( NULL == ( lat = calloc ( count, sizeof(*lat) ) ) ) )
+	{
+		fprintf ( stderr, "Memory alloc error\n" );
+		return	1;
+	}
+	// Known state first: KEY_A down and up again, after making
+	// hidclient send to the remote side if it does not yet
+	if ( 0 > sendkey ( fifo, KEY_A, 1 ) ) return 1;
+	if ( 0 == recvkeyb ( sint, REPTIMEOUT / 4 ) )
+	{
+		if ( ( 0 > sendkey ( fifo, KEY_SYSRQ, 1 ) ) ||
+		     ( 0 > sendkey ( fifo, KEY_SYSRQ, 0 ) ) )
+			return	1;
+	}
+	if ( ( 0 > sendkey ( fifo, KEY_A, 0 ) ) ||
+	     ( 1 != recvkeyb ( sint, REPTIMEOUT ) ) )
+	{
+		fprintf ( stderr, "hidclient does not send reports\n" );
+		return	1;
+	}
+	start = nowstamp ();
+	for ( i = j = 0; j < count; )
+	{
+		while ( ( i < count ) && ( i - j < window ) )
+		{	// Each event changes the state, so each is reported
+			sent[i] = nowstamp ();
+			if ( 0 > sendkey ( fifo, KEY_A, 1 - ( i & 1 ) ) )
+				return	1;
+			++i;
+		}
+		if ( 1 != ( k = recvkeyb ( sint, REPTIMEOUT ) ) )
+		{
+			fprintf ( stderr, "%s after %d of %d reports\n",
+				k ? "Connection closed" : "Timeout", j, count );
+			return	1;
+		}
+		lat[j] = nowstamp () - sent[j];
+		++j;
+	}
+	start = nowstamp () - start;
+	qsort ( lat, count, sizeof(*lat), cmpstamp );
+	printf ( "%d reports in %.3f s (%.0f reports/s), window %d\n",
+			count, start / 1e9, count * 1e9 / start, window );
+	printf ( "Latency event->report: p50 %.1f us, p99 %.1f us, "
+			"p99.9 %.1f us, max %.1f us\n",
+			lat[count / 2] / 1000.0,
+			lat[(int)( count * 0.99 )] / 1000.0,
+			lat[(int)( count * 0.999 )] / 1000.0,
+			lat[count - 1] / 1000.0 );
+	free ( sent );
+	free ( lat );
+	return	0;
+}
+
+int	main ( int argc, char ** argv )
+{
+	int	i, sctl, sint, fifo = -1, lctl = -1, lint = -1;
+	int	count = 10000, window = 1, listening = 0;
+	char	*fifoname = NULL;
+	for ( i = 2; i < argc; ++i )
+	{
+		if ( 0 == strncmp ( argv[i], "-f", 2 ) )
+		{
+			fifoname = argv[i] + 2;
+		}
+		else if ( 0 == strncmp ( argv[i], "-n", 2 ) )
+		{
+			count = atoi ( argv[i] + 2 );
+		}
+		else if ( 0 == strncmp ( argv[i], "-w", 2 ) )
+		{
+			window = atoi ( argv[i] + 2 );
+		}
+		else if ( 0 == strcmp ( argv[i], "-l" ) )
+		{
+			listening = 1;
+		}
+		else
+		{
+			fprintf ( stderr, "Invalid argument: \'%s\'\n", argv[i]);
+			return	1;
+		}
+	}
+	if ( ( argc < 2 ) || ( argv[1][0] == '-' ) ||
+	     ( count < 1 ) || ( window < 1 ) )
+	{
+		fprintf ( stderr, "Usage: %s <path> [-l] [-f<fifo> [-n<count>] "
+				"[-w<window>]]\n", argv[0] );
+		return	1;
+	}
+	if ( ( NULL != fifoname ) &&
+	     ( 0 > ( fifo = open ( fifoname, O_WRONLY ) ) ) )
+	{
+		fprintf ( stderr, "Failed to open fifo [%s]: %s\n", fifoname,
+				strerror ( errno ) );
+		return	2;
+	}
+	if ( listening &&
+	     ( ( 0 > ( lctl = hostlisten ( argv[1], "ctl" ) ) ) ||
+	       ( 0 > ( lint = hostlisten ( argv[1], "int" ) ) ) ) )
+	{
+		return	2;
+	}
+	do
+	{	// Control channel first, as a Bluetooth host does
+		if ( listening )
+		{
+			if ( ( 0 > ( sctl = hostaccept ( lctl, "control" ) ) ) ||
+			     ( 0 > ( sint = hostaccept ( lint, "interrupt" ) ) ) )
+				return	2;
+			fprintf ( stderr, "hidclient connected\n" );
+		}
+		else if ( ( 0 > ( sctl = hostconnect ( argv[1], "ctl" ) ) ) ||
+			  ( 0 > ( sint = hostconnect ( argv[1], "int" ) ) ) )
+		{
+			return	2;
+		}
+		i = ( fifo < 0 ) ? printreports ( sint ) :
+				drive ( sint, fifo, count, window );
+		close ( sint );
+		close ( sctl );
+	} while ( listening && ( fifo < 0 ) );
+	if ( fifo >= 0 ) close ( fifo );
+	return	i;
+}
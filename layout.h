@@ -0,0 +1,42 @@
+/*
+ * layout.h - Binary keyboard layout files for hidclient
+ *
+ *	Written by mklayout from a text source, read into memory by
+ *	hidclient (-k) and used directly as its lookup table, with no
+ *	parsing. hidclient copies the file rather than mapping it, as it
+ *	may be rewritten while hidclient runs (see readlayout).
+ *
+ *	A file is one header followed by rows * layers entries of two bytes:
+ *	entry[usage][layer] = { modifier byte, HID usage to send }
+ *	A usage to send of 0 means the key sends nothing on that layer.
+ *	All multi-byte values are little endian.
+ *
+ * License:	GPL v2, see hidclient.c
+ */
+
+#ifndef	LAYOUT_H
+#define	LAYOUT_H
+
+#include <stdint.h>
+
+#define	LAYOUT_MAGIC	"HCLY"
+#define	LAYOUT_VERSION	1
+
+// Limits: rows are indexed by HID keyboard usage (8 bit), layers by the
+// Neo layer hidclient selects from the modifiers held (see neolayer)
+#define	LAYOUT_MAXROWS		256
+#define	LAYOUT_MAXLAYERS	6
+
+struct layout_header
+{
+	char		magic[4];	// LAYOUT_MAGIC, not 0-terminated
+	uint16_t	version;	// LAYOUT_VERSION
+	uint16_t	rows;		// number of HID usages covered
+	uint16_t	layers;		// number of layers per usage
+	uint16_t	reserved;	// 0
+} __attribute((packed));
+
+#define	LAYOUT_BYTES(rows,layers)	( sizeof(struct layout_header) + \
+					  (size_t)(rows) * (layers) * 2 )
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * mkbench - Write synthetic input event recordings for benchmarking
+ *
+ * Usage:	mkbench <typing|chords|mouse> <count> <out.rec>
+ *		Writes about count input events in the format of hidclient -R
+ *		(see evrec.h), to be replayed with hidclient -P<out.rec> -F.
+ *		Events come in frames like a real keyboard or mouse sends
+ *		them (EV_MSC scancode, EV_KEY, EV_SYN), and the same stream is
+ *		generated every time, so runs can be compared:
+ *		typing	letter keys weighted by letter frequency in German
+ *			text, spaces, some shifted letters and rollover
+ *			(next key pressed before the previous one is released)
+ *		chords	Neo layer keys held (mod3: CapsLock/#, mod4: </AltGr,
+ *			with and without shift) while typing 1-3 keys on
+ *			layers 3 to 6
+ *		mouse	a 1000 Hz mouse: motion in every frame, sometimes
+ *			the wheel, a click now and then
+ *
+ * License:	GPL v2, see hidclient.c
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <linux/input.h>
+#include "evrec.h"
+
+FILE		*out;
+unsigned long	nevents = 0;
+unsigned int	pending = 0;	// microseconds until the next event
+uint32_t	rngstate = 2463534242U;
+
+void		emit(int,int,int);
+void		frame(int,int);
+void		later(unsigned int);
+unsigned int	rnd(unsigned int);
+int		letter(void);
+void		typing(unsigned long);
+void		chords(unsigned long);
+void		mouse(unsigned long);
+
+// Write one event, pending microseconds after the previous one
+void	emit ( int type, int code, int value )
+{
+	struct evrec_t	rec;
+	rec.delta = htole32 ( pending );
+	rec.type  = htole16 ( type );
+	rec.code  = htole16 ( code );
+	rec.value = htole32 ( value );
+	fwrite ( &rec, sizeof(rec), 1, out );
+	pending = 0;
+	++nevents;
+	return;
+}
+
+// A key frame as a keyboard sends it: scancode, key, end of frame
+void	frame ( int code, int value )
+{
+	emit ( EV_MSC, MSC_SCAN, 0x70000 + code );
+	emit ( EV_KEY, code, value );
+	emit ( EV_SYN, SYN_REPORT, 0 );
+	return;
+}
+
+void	later ( unsigned int us )
+{
+	pending += us;
+	return;
+}
+
+// Pseudo random number 0..n-1 (xorshift32, fixed seed)
+unsigned int	rnd ( unsigned int n )
+{
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 17;
+	rngstate ^= rngstate << 5;
+	return	rngstate % n;
+}
+
+// A letter key, weighted by frequency of the letter in German text (per mille)
+int	letter ( void )
+{
+	static const struct { int code, freq; } letters[] = {
+		{ KEY_E, 174 }, { KEY_N, 98 }, { KEY_I, 76 }, { KEY_S, 73 },
+		{ KEY_R, 70 }, { KEY_A, 65 }, { KEY_T, 62 }, { KEY_D, 51 },
+		{ KEY_H, 48 }, { KEY_U, 44 }, { KEY_L, 34 }, { KEY_C, 31 },
+		{ KEY_G, 30 }, { KEY_M, 25 }, { KEY_O, 25 }, { KEY_B, 19 },
+		{ KEY_W, 19 }, { KEY_F, 17 }, { KEY_K, 12 }, { KEY_Z, 11 },
+		{ KEY_P, 8 }, { KEY_V, 7 }, { KEY_SEMICOLON, 5 },
+		{ KEY_APOSTROPHE, 5 }, { KEY_LEFTBRACE, 6 }, { KEY_J, 3 },
+		{ KEY_Y, 1 }, { KEY_X, 1 }, { KEY_Q, 1 } };
+	int	i, r = rnd ( 1000 );
+	for ( i = 0; i < sizeof(letters)/sizeof(letters[0]) - 1; ++i )
+	{
+		if ( ( r -= letters[i].freq ) < 0 ) break;
+	}
+	return	letters[i].code;
+}
+
+// Typing at about 300 keys per minute
+void	typing ( unsigned long count )
+{
+	int	code, prev = 0, shift;
+	while ( nevents < count )
+	{
+		code = ( rnd ( 6 ) == 0 ) ? KEY_SPACE : letter ();
+		shift = ( code != KEY_SPACE ) && ( rnd ( 10 ) == 0 );
+		if ( shift ) { later ( 60000 ); frame ( KEY_LEFTSHIFT, 1 ); }
+		later ( 80000 + rnd ( 120000 ) );
+		frame ( code, 1 );
+		if ( prev )
+		{	// Rollover: previous key released only now
+			later ( 20000 );
+			frame ( prev, 0 );
+		}
+		if ( shift || ( code == prev ) || ( rnd ( 3 ) != 0 ) )
+		{
+			later ( 60000 + rnd ( 60000 ) );
+			frame ( code, 0 );
+			prev = 0;
+		}
+		else	prev = code;
+		if ( shift ) { later ( 30000 ); frame ( KEY_LEFTSHIFT, 0 ); }
+	}
+	if ( prev ) frame ( prev, 0 );
+	return;
+}
+
+// Neo layers 3 to 6: mod3, mod4, shift+mod3, mod3+mod4 held while typing
+void	chords ( unsigned long count )
+{
+	static const int	mods[][2] = {
+		{ KEY_CAPSLOCK, 0 }, { KEY_BACKSLASH, 0 },
+		{ KEY_102ND, 0 }, { KEY_RIGHTALT, 0 },
+		{ KEY_LEFTSHIFT, KEY_CAPSLOCK },
+		{ KEY_CAPSLOCK, KEY_RIGHTALT }, { KEY_BACKSLASH, KEY_102ND } };
+	int	m, i, n, code;
+	while ( nevents < count )
+	{
+		m = rnd ( sizeof(mods)/sizeof(mods[0]) );
+		later ( 100000 );
+		frame ( mods[m][0], 1 );
+		if ( mods[m][1] ) { later ( 40000 ); frame ( mods[m][1], 1 ); }
+		for ( i = 0, n = 1 + rnd ( 3 ); i < n; ++i )
+		{
+			code = ( rnd ( 2 ) == 0 ) ? letter () : KEY_1 + rnd ( 10 );
+			later ( 80000 + rnd ( 80000 ) );
+			frame ( code, 1 );
+			later ( 60000 + rnd ( 40000 ) );
+			frame ( code, 0 );
+		}
+		if ( mods[m][1] ) { later ( 30000 ); frame ( mods[m][1], 0 ); }
+		later ( 30000 );
+		frame ( mods[m][0], 0 );
+	}
+	return;
+}
+
+// A mouse reporting every millisecond
+void	mouse ( unsigned long count )
+{
+	int	buttons = 0, b;
+	while ( nevents < count )
+	{
+		later ( 1000 );
+		emit ( EV_REL, REL_X, (int)rnd ( 41 ) - 20 );
+		emit ( EV_REL, REL_Y, (int)rnd ( 41 ) - 20 );
+		if ( rnd ( 50 ) == 0 )
+			emit ( EV_REL, REL_WHEEL, rnd ( 2 ) ? 1 : -1 );
+		if ( rnd ( 200 ) == 0 )
+		{	// Press or release a button
+			b = rnd ( 3 );
+			buttons ^= 1 << b;
+			emit ( EV_MSC, MSC_SCAN, 0x90001 + b );
+			emit ( EV_KEY, BTN_LEFT + b, ( buttons >> b ) & 1 );
+		}
+		emit ( EV_SYN, SYN_REPORT, 0 );
+	}
+	return;
+}
+
+int	main ( int argc, char ** argv )
+{
+	unsigned long	count;
+	if ( ( argc != 4 ) || ( 0 == ( count = strtoul ( argv[2], NULL, 0 ) ) ) )
+	{
+		fprintf ( stderr, "Usage: %s <typing|chords|mouse> <count> "
+				"<out.rec>\n", argv[0] );
+		return	1;
+	}
+	if ( NULL == ( out = fopen ( argv[3], "w" ) ) )
+	{
+		fprintf ( stderr, "Failed to create [%s]: %s\n", argv[3],
+				strerror ( errno ) );
+		return	2;
+	}
+	fwrite ( EVREC_MAGIC, 1, sizeof(EVREC_MAGIC) - 1, out );
+	if ( 0 == strcmp ( argv[1], "typing" ) )
+		typing ( count );
+	else if ( 0 == strcmp ( argv[1], "chords" ) )
+		chords ( count );
+	else if ( 0 == strcmp ( argv[1], "mouse" ) )
+		mouse ( count );
+	else
+	{
+		fprintf ( stderr, "Unknown stream [%s]\n", argv[1] );
+		fclose ( out );
+		remove ( argv[3] );
+		return	1;
+	}
+	if ( 0 != fclose ( out ) )
+	{
+		fprintf ( stderr, "Failed to write [%s]\n", argv[3] );
+		return	2;
+	}
+	return	0;
+}
@@ -0,0 +1,150 @@
+/*
+ * mklayout - Build binary keyboard layout files for hidclient
+ *
+ * Usage:	mklayout <source.txt> <layout.bin>
+ *		Reads a readable layout source (see layouts/neo-de-apple.txt
+ *		for the format) and writes the binary layout file that
+ *		hidclient reads with -k<layout.bin>.
+ *		The output is written to a temporary file first and renamed,
+ *		so a running hidclient never sees a partially written file.
+ *
+ * License:
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License as
+ *		published by the Free Software Foundation;
+ *		strictly version 2 only.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "layout.h"
+
+int	main ( int argc, char ** argv )
+{
+	FILE		*in, *out;
+	char		line[1024], tmpname[4096];
+	char		*p, *q;
+	unsigned char	*table = NULL;
+	struct layout_header	hdr;
+	long		usage;
+	unsigned int	mod, key, layer;
+	int		layers = 0, rows = 0, lineno = 0;
+	if ( argc != 3 )
+	{
+		fprintf ( stderr, "Usage: %s <source.txt> <layout.bin>\n", argv[0] );
+		return	1;
+	}
+	if ( NULL == ( in = fopen ( argv[1], "r" ) ) )
+	{
+		fprintf ( stderr, "Failed to open [%s]: %s\n", argv[1],
+				strerror ( errno ) );
+		return	2;
+	}
+	while ( fgets ( line, sizeof(line), in ) )
+	{
+		++lineno;
+		if ( NULL != ( p = strchr ( line, '#' ) ) ) *p = 0;
+		p = line + strspn ( line, " \t\r\n" );
+		if ( *p == 0 ) continue;
+		if ( 0 == strncmp ( p, "layers", 6 ) )
+		{
+			if ( table != NULL )
+			{
+				fprintf ( stderr, "%s:%d: layers must be set "
+					"once, before the first key\n",
+					argv[1], lineno );
+				free ( table );
+				return	3;
+			}
+			layers = atoi ( p + 6 );
+			if ( ( layers < 1 ) || ( layers > LAYOUT_MAXLAYERS ) )
+			{
+				fprintf ( stderr, "%s:%d: layers must be "
+					"1..%d\n", argv[1], lineno,
+					LAYOUT_MAXLAYERS );
+				return	3;
+			}
+			table = calloc ( LAYOUT_MAXROWS, layers * 2 );
+			if ( table == NULL )
+			{
+				fprintf ( stderr, "Memory alloc error\n" );
+				return	3;
+			}
+			continue;
+		}
+		if ( table == NULL )
+		{
+			fprintf ( stderr, "%s:%d: layers not set\n",
+					argv[1], lineno );
+			return	3;
+		}
+		usage = strtol ( p, &q, 0 );
+		if ( ( q == p ) || ( usage <= 0 ) || ( usage >= LAYOUT_MAXROWS ) )
+		{
+			fprintf ( stderr, "%s:%d: invalid usage\n",
+					argv[1], lineno );
+			free ( table );
+			return	3;
+		}
+		for ( layer = 0; ; ++layer )
+		{
+			p = q + strspn ( q, " \t\r\n" );
+			if ( *p == 0 ) break;
+			if ( ( layer >= layers ) ||
+			     ( 2 != sscanf ( p, "%2x:%2x", &mod, &key ) ) )
+			{
+				fprintf ( stderr, "%s:%d: invalid entry for "
+					"layer %u\n", argv[1], lineno, layer+1 );
+				free ( table );
+				return	3;
+			}
+			table[(usage*layers+layer)*2]   = mod;
+			table[(usage*layers+layer)*2+1] = key;
+			q = p + strcspn ( p, " \t\r\n" );
+		}
+		if ( usage >= rows ) rows = usage + 1;
+	}
+	fclose ( in );
+	if ( rows == 0 )
+	{
+		fprintf ( stderr, "%s: no keys defined\n", argv[1] );
+		free ( table );
+		return	3;
+	}
+	memcpy ( hdr.magic, LAYOUT_MAGIC, sizeof(hdr.magic) );
+	hdr.version  = htole16 ( LAYOUT_VERSION );
+	hdr.rows     = htole16 ( rows );
+	hdr.layers   = htole16 ( layers );
+	hdr.reserved = 0;
+	snprintf ( tmpname, sizeof(tmpname), "%s.tmp", argv[2] );
+	if ( NULL == ( out = fopen ( tmpname, "w" ) ) )
+	{
+		fprintf ( stderr, "Failed to create [%s]: %s\n", tmpname,
+				strerror ( errno ) );
+		free ( table );
+		return	4;
+	}
+	if ( ( 1 != fwrite ( &hdr, sizeof(hdr), 1, out ) ) ||
+	     ( 1 != fwrite ( table, rows * layers * 2, 1, out ) ) ||
+	     ( 0 != fclose ( out ) ) )
+	{
+		fprintf ( stderr, "Failed to write [%s]\n", tmpname );
+		remove ( tmpname );
+		free ( table );
+		return	4;
+	}
+	if ( 0 != rename ( tmpname, argv[2] ) )
+	{
+		fprintf ( stderr, "Failed to rename [%s] to [%s]: %s\n",
+				tmpname, argv[2], strerror ( errno ) );
+		remove ( tmpname );
+		free ( table );
+		return	4;
+	}
+	fprintf ( stdout, "%s: %d keys, %d layers\n", argv[2], rows, layers );
+	free ( table );
+	return	0;
+}